@@ -0,0 +1,138 @@
+#include <iostream>
+#include <map>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <random>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "atomic_hash_map.hpp"
+
+uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+atomic_hash_map *m_hash;
+
+const int kMaxThreadNum = 128;
+
+pthread_t tid[kMaxThreadNum];
+
+uint32_t thread_num = 1;
+
+uint32_t element_num = 10000000;
+
+// fraction of the elements the table is sized for up front,
+// the rest is absorbed by the cooperative growth
+double presize = 1.0;
+
+
+
+void *func_insert(void *arg) {
+  using namespace std;
+
+  uint64_t id = (uintptr_t)arg;
+  id *= element_num;
+  for (uint64_t i = 0; i < element_num; i++) {
+    m_hash->insert(i + id, i + id);
+  }
+  return NULL;
+}
+
+void test_hash_insert() {
+  delete m_hash;
+  m_hash = new atomic_hash_map((uint64_t)thread_num * element_num * presize);
+
+  uint64_t st, ed;
+
+  st = NowMicros();
+  for (uintptr_t i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, func_insert, (void *)i);
+  }
+  for (uint32_t i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+
+  printf("insert %lu elements, time cost %lu us, size %lu, submaps %lu\n",
+         (uint64_t)thread_num * (uint64_t)element_num, ed - st,
+         m_hash->size(), m_hash->num_submaps());
+}
+
+void *func_lookup(void *arg) {
+  using namespace std;
+
+  uint64_t id = (uintptr_t)arg;
+  id *= element_num;
+  uint64_t tt = 0;
+  for (uint64_t i = 0; i < element_num; i++) {
+    uint64_t value = 0;
+    bool found = m_hash->find(i + id, value);
+    assert(found && value == i + id);
+    tt += value;
+  }
+  return (void *)tt;
+}
+
+void test_hash_lookup() {
+
+  uint64_t st, ed;
+
+  st = NowMicros();
+  for (uintptr_t i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, func_lookup, (void *)i);
+  }
+  for (uint32_t i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+
+  printf("lookup %lu elements, time cost %lu us\n", (uint64_t)thread_num * (uint64_t)element_num, ed - st);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: atomic_hash [-t thread_num] [-e element_num] [-p presize]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+
+  while (-1 != (c = getopt(argc, argv, "ht:e:p:"))) {
+    switch (c) {
+      case 't':
+        thread_num = std::atol(optarg);
+        break;
+      case 'e':
+        element_num = std::atol(optarg);
+        break;
+      case 'p':
+        presize = std::atof(optarg);
+        break;
+      case 'h':
+        usage();
+        return 0;
+      default:
+        usage();
+        return 0;
+    }
+  }
+  if (thread_num > kMaxThreadNum) {
+    thread_num = kMaxThreadNum;
+  }
+  printf("thread_num %u element_num %u\n", thread_num, element_num);
+
+  test_hash_insert();
+
+  test_hash_lookup();
+
+  delete m_hash;
+  return 0;
+}
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "fast_hash.hpp"
+
+constexpr size_t ATOMIC_HASH_CACHE_LINE_SIZE = 64;
+
+/** Lock free hash map for 64-bit integer keys and values.
+
+ Implementation of the Maged Michael / Folly AtomicHashMap scheme: key/value
+ pairs live directly in flat arrays of 16-byte cells (four to a cache line),
+ a cell is claimed with a single CAS on its key, collisions are resolved by
+ linear probing, and a lookup usually touches one or two cache lines.
+
+ The table never rehashes. When a sub-table reaches its maximum load, the
+ thread that wins the CAS on m_num_submaps allocates the next, bigger,
+ sub-table and all threads cooperatively continue there; elements that are
+ already in place are never moved, so growing costs one allocation and no
+ stop-the-world copy. Lookups probe the sub-tables in order, the primary
+ sub-table holds most elements if the initial capacity is sized sensibly.
+
+ Three key values are reserved (EMPTY_KEY, LOCKED_KEY, ERASED_KEY). Erased
+ cells are tombstones and are never reused, that keeps a key unique across
+ all sub-tables without any locking. */
+class atomic_hash_map {
+ public:
+  static constexpr uint64_t EMPTY_KEY = ~0ULL;
+  static constexpr uint64_t LOCKED_KEY = ~0ULL - 1;
+  static constexpr uint64_t ERASED_KEY = ~0ULL - 2;
+
+  /** Constructor
+  @param[in]	capacity	Expected number of elements, the primary
+                                sub-table is sized for it
+  @param[in]	max_load	Load factor at which a sub-table is full
+  @param[in]	growth		Size of each new sub-table relative to the
+                                previous one
+  @throw std::bad_alloc if the primary sub-table can't be allocated */
+  explicit atomic_hash_map(size_t capacity, double max_load = 0.8,
+                           double growth = 2.0)
+      : m_max_load(max_load), m_growth(growth) {
+    assert(max_load > 0 && max_load < 1);
+    for (size_t i = 0; i < MAX_SUBMAPS; ++i) {
+      m_submaps[i].store(nullptr, std::memory_order_relaxed);
+    }
+    Submap *submap = new_submap(capacity / max_load + 1);
+    if (submap == nullptr) {
+      throw std::bad_alloc();
+    }
+    m_submaps[0].store(submap, std::memory_order_relaxed);
+    m_num_submaps.store(1, std::memory_order_relaxed);
+  }
+
+  /** Destructor */
+  ~atomic_hash_map() {
+    for (size_t i = 0; i < MAX_SUBMAPS; ++i) {
+      Submap *submap = m_submaps[i].load(std::memory_order_relaxed);
+      if (submap != nullptr) {
+        free(submap->m_cells);
+        delete submap;
+      }
+    }
+  }
+
+  /** Insert a key/value pair
+  @param[in]	key		Key, must not be one of the reserved keys
+  @param[in]	value		Value
+  @return true if inserted, false if the key exists or the map is full,
+  which includes a sub-table that could not be allocated */
+  bool insert(uint64_t key, uint64_t value) {
+    assert(key < ERASED_KEY);
+    size_t hash = hash_key(key);
+
+    for (uint32_t i = 0;; ++i) {
+      Submap *submap = get_submap(i);
+      if (submap == nullptr) {
+        return (false); /* MAX_SUBMAPS reached or out of memory */
+      }
+
+      switch (submap_insert(submap, hash, key, value)) {
+        case INSERTED:
+          return (true);
+        case EXISTS:
+          return (false);
+        case FULL:
+          /* No new insert can start in a full sub-table. Let the ones
+          in flight finish, one of them may be inserting our key */
+          while (submap->m_pending.load() != 0) {
+            sched_yield();
+          }
+          if (submap_find(submap, hash, key) != nullptr) {
+            return (false);
+          }
+          break;
+      }
+    }
+  }
+
+  /** Look up a key
+  @param[in]	key		Key to look up
+  @param[out]	value		Value of the key, untouched if not found
+  @return true if found */
+  bool find(uint64_t key, uint64_t &value) const {
+    Cell *cell = find_cell(key);
+    if (cell == nullptr) {
+      return (false);
+    }
+    value = cell->m_value.load(std::memory_order_relaxed);
+    return (true);
+  }
+
+  /** Erase a key, the cell becomes a tombstone
+  @param[in]	key		Key to erase
+  @return true if the key was erased by this call */
+  bool erase(uint64_t key) {
+    Cell *cell = find_cell(key);
+    if (cell == nullptr) {
+      return (false);
+    }
+    uint64_t expected = key;
+    if (cell->m_key.compare_exchange_strong(expected, ERASED_KEY,
+                                            std::memory_order_acq_rel)) {
+      m_erased.fetch_add(1, std::memory_order_relaxed);
+      return (true);
+    }
+    return (false);
+  }
+
+  /** @return number of elements, not exact while there are writers */
+  size_t size() const {
+    size_t n = 0;
+    uint32_t num_submaps = m_num_submaps.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < num_submaps; ++i) {
+      Submap *submap = m_submaps[i].load(std::memory_order_acquire);
+      if (submap != nullptr) {
+        n += submap->m_claimed.load(std::memory_order_relaxed);
+      }
+    }
+    return (n - m_erased.load(std::memory_order_relaxed));
+  }
+
+  /** @return number of sub-tables in use */
+  size_t num_submaps() const {
+    return (m_num_submaps.load(std::memory_order_acquire));
+  }
+
+  /** @return total number of cells over all sub-tables */
+  size_t capacity() const {
+    size_t n = 0;
+    uint32_t num_submaps = m_num_submaps.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < num_submaps; ++i) {
+      Submap *submap = m_submaps[i].load(std::memory_order_acquire);
+      if (submap != nullptr) {
+        n += submap->m_mask + 1;
+      }
+    }
+    return (n);
+  }
+
+ private:
+  static constexpr uint32_t MAX_SUBMAPS = 32;
+
+  using Pad = char[ATOMIC_HASH_CACHE_LINE_SIZE];
+
+  struct Cell {
+    std::atomic<uint64_t> m_key;
+    std::atomic<uint64_t> m_value;
+  };
+
+  struct Submap {
+    Cell *m_cells;
+    size_t m_mask;
+    size_t m_max_claimed;
+    Pad m_pad0;
+    /** cells ever claimed, tombstones included */
+    std::atomic<size_t> m_claimed;
+    /** inserts in progress */
+    std::atomic<uint32_t> m_pending;
+    /** set once, no insert starts after that */
+    std::atomic<bool> m_full;
+    Pad m_pad1;
+  };
+
+  enum insert_result { INSERTED, EXISTS, FULL };
+
+  /** murmur3 finalizer, sequential keys must not land in sequential cells
+  or linear probing degenerates */
+  static size_t hash_key(uint64_t key) { return (murmur_mix(key)); }
+
+  Submap *new_submap(size_t n_cells) const {
+    size_t capacity = 16;
+    while (capacity < n_cells) {
+      capacity <<= 1;
+    }
+
+    void *cells = nullptr;
+    if (posix_memalign(&cells, ATOMIC_HASH_CACHE_LINE_SIZE,
+                       capacity * sizeof(Cell))) {
+      return (nullptr);
+    }
+    Submap *submap = new (std::nothrow) Submap;
+    if (submap == nullptr) {
+      free(cells);
+      return (nullptr);
+    }
+    /* all ones is EMPTY_KEY */
+    memset(cells, 0xff, capacity * sizeof(Cell));
+
+    submap->m_cells = static_cast<Cell *>(cells);
+    submap->m_mask = capacity - 1;
+    submap->m_max_claimed = capacity * m_max_load;
+    submap->m_claimed.store(0, std::memory_order_relaxed);
+    submap->m_pending.store(0, std::memory_order_relaxed);
+    submap->m_full.store(false, std::memory_order_relaxed);
+    return (submap);
+  }
+
+  /** Get sub-table i, allocate it if i is the first one not yet in use.
+  The thread that moves m_num_submaps allocates, the others wait for it to
+  publish the pointer. If the allocation fails, the map is full for good.
+  @return the sub-table or nullptr if MAX_SUBMAPS is reached or a sub-table
+  could not be allocated */
+  Submap *get_submap(uint32_t i) {
+    if (i >= MAX_SUBMAPS) {
+      return (nullptr);
+    }
+
+    uint32_t num_submaps = m_num_submaps.load(std::memory_order_acquire);
+    if (i >= num_submaps) {
+      if (m_num_submaps.compare_exchange_strong(num_submaps, i + 1,
+                                                std::memory_order_acq_rel)) {
+        Submap *prev = get_submap(i - 1);
+        Submap *submap = new_submap((prev->m_mask + 1) * m_growth);
+        if (submap == nullptr) {
+          /* m_submaps[i] stays nullptr, the waiters below give up too */
+          m_grow_failed.store(true, std::memory_order_release);
+          return (nullptr);
+        }
+        m_submaps[i].store(submap, std::memory_order_release);
+      }
+    }
+
+    Submap *submap;
+    while ((submap = m_submaps[i].load(std::memory_order_acquire)) ==
+           nullptr) {
+      if (m_grow_failed.load(std::memory_order_acquire)) {
+        return (nullptr);
+      }
+      sched_yield();
+    }
+    return (submap);
+  }
+
+  /** Wait for a concurrent insert to publish the key of a cell */
+  static uint64_t load_key(const Cell *cell) {
+    uint64_t key;
+    while ((key = cell->m_key.load(std::memory_order_acquire)) ==
+           LOCKED_KEY) {
+      sched_yield();
+    }
+    return (key);
+  }
+
+  insert_result submap_insert(Submap *submap, size_t hash, uint64_t key,
+                              uint64_t value) {
+    if (submap->m_full.load()) {
+      return (FULL);
+    }
+    submap->m_pending.fetch_add(1);
+    if (submap->m_full.load()) {
+      submap->m_pending.fetch_sub(1);
+      return (FULL);
+    }
+
+    insert_result res = FULL;
+    size_t idx = hash & submap->m_mask;
+
+    for (size_t probes = 0; probes <= submap->m_mask; ++probes) {
+      Cell *cell = &submap->m_cells[idx];
+      uint64_t cur = load_key(cell);
+
+      if (cur == key) {
+        res = EXISTS;
+        break;
+      }
+
+      if (cur == EMPTY_KEY) {
+        /* Reserve a cell before claiming it, so the sub-table never goes
+        past its maximum load and the probe sequences stay short */
+        if (submap->m_claimed.fetch_add(1, std::memory_order_relaxed) >=
+            submap->m_max_claimed) {
+          submap->m_claimed.fetch_sub(1, std::memory_order_relaxed);
+          submap->m_full.store(true);
+          break;
+        }
+
+        if (cell->m_key.compare_exchange_strong(cur, LOCKED_KEY,
+                                                std::memory_order_acq_rel)) {
+          cell->m_value.store(value, std::memory_order_relaxed);
+          cell->m_key.store(key, std::memory_order_release);
+          res = INSERTED;
+          break;
+        }
+
+        /* Somebody else claimed it first, it may be our key */
+        submap->m_claimed.fetch_sub(1, std::memory_order_relaxed);
+        if (load_key(cell) == key) {
+          res = EXISTS;
+          break;
+        }
+      }
+
+      idx = (idx + 1) & submap->m_mask;
+    }
+
+    if (res == FULL) {
+      submap->m_full.store(true);
+    }
+    submap->m_pending.fetch_sub(1);
+    return (res);
+  }
+
+  static Cell *submap_find(const Submap *submap, size_t hash, uint64_t key) {
+    size_t idx = hash & submap->m_mask;
+
+    for (size_t probes = 0; probes <= submap->m_mask; ++probes) {
+      Cell *cell = &submap->m_cells[idx];
+      uint64_t cur = load_key(cell);
+
+      if (cur == key) {
+        return (cell);
+      }
+      if (cur == EMPTY_KEY) {
+        break;
+      }
+      idx = (idx + 1) & submap->m_mask;
+    }
+    return (nullptr);
+  }
+
+  Cell *find_cell(uint64_t key) const {
+    assert(key < ERASED_KEY);
+    size_t hash = hash_key(key);
+    uint32_t num_submaps = m_num_submaps.load(std::memory_order_acquire);
+
+    for (uint32_t i = 0; i < num_submaps; ++i) {
+      Submap *submap = m_submaps[i].load(std::memory_order_acquire);
+      if (submap == nullptr) {
+        /* being allocated, it cannot hold anything yet */
+        break;
+      }
+
+      Cell *cell = submap_find(submap, hash, key);
+      if (cell != nullptr) {
+        return (cell);
+      }
+    }
+    return (nullptr);
+  }
+
+  double const m_max_load;
+  double const m_growth;
+  Pad m_pad0;
+  std::atomic<Submap *> m_submaps[MAX_SUBMAPS];
+  std::atomic<uint32_t> m_num_submaps;
+  /** set when a sub-table could not be allocated */
+  std::atomic<bool> m_grow_failed{false};
+  Pad m_pad1;
+  std::atomic<size_t> m_erased{0};
+  Pad m_pad2;
+
+  atomic_hash_map(atomic_hash_map &&) = delete;
+  atomic_hash_map(const atomic_hash_map &) = delete;
+  atomic_hash_map &operator=(atomic_hash_map &&) = delete;
+  atomic_hash_map &operator=(const atomic_hash_map &) = delete;
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+
+/** Fast, well mixing hash functions.
+
+ Every hash comes in two forms: a mixer of one 64-bit integer, and a hash
+ of a byte string with the lf_hash_func signature of LF_HASH
+ (ulint f(const uchar *key, size_t len)). The functors at the end wrap the
+ mixers for ska::flat_hash_map / sherwood_v3_table. All of them mix the low
+ bits well, so they are safe with power of two tables: LF_HASH picks a
+ bucket as hash % size with a power of two size.
+
+ - murmur: the murmur3 64-bit finalizer, and MurmurHash64A for strings.
+ - wy: a wyhash style 64x64->128 bit multiply-and-fold.
+ - crc32: CRC32C, with the SSE4.2 instruction when the CPU has it (checked
+   once at run time) and a table-less software fallback. Only 32 bits of
+   hash, and CRC is linear, but it's the cheapest on x86. */
+
+namespace ska {
+struct power_of_two_hash_policy;
+}
+
+/** murmur3 fmix64 */
+inline uint64_t murmur_mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return (key);
+}
+
+constexpr uint64_t WY_P0 = 0xa0761d6478bd642fULL;
+constexpr uint64_t WY_P1 = 0xe7037ed1a0b428dbULL;
+constexpr uint64_t WY_P2 = 0x8ebc6af09c88c6e3ULL;
+
+/** Multiply to 128 bits and fold the halves */
+inline uint64_t wy_mum(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return (static_cast<uint64_t>(r >> 64) ^ static_cast<uint64_t>(r));
+}
+
+inline uint64_t wy_mix(uint64_t key) {
+  return (wy_mum(wy_mum(key ^ WY_P0, key ^ WY_P1), WY_P2));
+}
+
+/** Read up to 8 bytes as a little endian word, zero padded */
+inline uint64_t fast_hash_read(const unsigned char *p, size_t len) {
+  uint64_t word = 0;
+  memcpy(&word, p, len < 8 ? len : 8);
+  return (word);
+}
+
+/** MurmurHash64A */
+inline uint64_t fast_hash_murmur(const unsigned char *key, size_t len) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  uint64_t h = 0x8445d61a4e774912ULL ^ (len * m);
+
+  for (; len >= 8; key += 8, len -= 8) {
+    uint64_t k = fast_hash_read(key, 8) * m;
+    k ^= k >> 47;
+    h = (h ^ (k * m)) * m;
+  }
+  if (len) {
+    h = (h ^ fast_hash_read(key, len)) * m;
+  }
+  h ^= h >> 47;
+  h *= m;
+  h ^= h >> 47;
+  return (h);
+}
+
+inline uint64_t fast_hash_wy(const unsigned char *key, size_t len) {
+  uint64_t h = WY_P2 ^ len;
+
+  for (; len >= 8; key += 8, len -= 8) {
+    h = wy_mum(fast_hash_read(key, 8) ^ WY_P0, h ^ WY_P1);
+  }
+  if (len) {
+    h = wy_mum(fast_hash_read(key, len) ^ WY_P0, h ^ WY_P1);
+  }
+  return (wy_mum(h ^ WY_P2, WY_P1));
+}
+
+/** CRC32C (Castagnoli) of one byte, bit by bit */
+inline uint32_t crc32c_soft_u8(uint32_t crc, uint8_t byte) {
+  crc ^= byte;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc >> 1) ^ (0x82f63b78U & (0U - (crc & 1)));
+  }
+  return (crc);
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) inline uint64_t fast_hash_crc32_hw(
+    const unsigned char *key, size_t len) {
+  uint64_t crc = ~0U;
+  for (; len >= 8; key += 8, len -= 8) {
+    crc = _mm_crc32_u64(crc, fast_hash_read(key, 8));
+  }
+  for (; len; key++, len--) {
+    crc = _mm_crc32_u8(static_cast<uint32_t>(crc), *key);
+  }
+  return (crc ^ ~0U);
+}
+
+inline bool fast_hash_have_crc32() {
+  static const bool have = __builtin_cpu_supports("sse4.2");
+  return (have);
+}
+#else
+inline uint64_t fast_hash_crc32_hw(const unsigned char *, size_t) {
+  return (0);
+}
+
+inline bool fast_hash_have_crc32() { return (false); }
+#endif
+
+inline uint64_t fast_hash_crc32(const unsigned char *key, size_t len) {
+  if (fast_hash_have_crc32()) {
+    return (fast_hash_crc32_hw(key, len));
+  }
+  uint32_t crc = ~0U;
+  for (; len; key++, len--) {
+    crc = crc32c_soft_u8(crc, *key);
+  }
+  return (crc ^ ~0U);
+}
+
+inline uint64_t crc32_mix(uint64_t key) {
+  return (fast_hash_crc32(reinterpret_cast<const unsigned char *>(&key),
+                          sizeof(key)));
+}
+
+/** Hashers for ska::flat_hash_map and friends, of integral keys */
+struct murmur_hasher {
+  typedef ska::power_of_two_hash_policy hash_policy;
+  size_t operator()(uint64_t key) const { return (murmur_mix(key)); }
+};
+
+struct wy_hasher {
+  typedef ska::power_of_two_hash_policy hash_policy;
+  size_t operator()(uint64_t key) const { return (wy_mix(key)); }
+};
+
+struct crc32_hasher {
+  typedef ska::power_of_two_hash_policy hash_policy;
+  size_t operator()(uint64_t key) const { return (crc32_mix(key)); }
+};
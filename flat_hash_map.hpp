@@ -13,10 +13,15 @@
 #include <utility>
 #include <type_traits>
 
+#include "fast_hash.hpp"
+
 #ifdef _MSC_VER
+#include <xmmintrin.h>
 #define SKA_NOINLINE(...) __declspec(noinline) __VA_ARGS__
+#define SKA_PREFETCH(address) _mm_prefetch(reinterpret_cast<const char *>(address), _MM_HINT_T0)
 #else
 #define SKA_NOINLINE(...) __VA_ARGS__ __attribute__((noinline))
+#define SKA_PREFETCH(address) __builtin_prefetch(address)
 #endif
 
 namespace ska
@@ -24,9 +29,29 @@ namespace ska
 struct prime_number_hash_policy;
 struct power_of_two_hash_policy;
 struct fibonacci_hash_policy;
+struct aos_layout;
 
 namespace detailv3
 {
+// template<typename...> using void_t = void;
+template <typename...>
+struct voider { using type = void; };
+
+template <typename... Ts>
+using void_t = typename voider<Ts...>::type;
+
+// Key, if Functor has an is_transparent typedef: it can hash or compare
+// other types than the key type, so lookups don't have to build a key
+template<typename Functor, typename Key, typename = void>
+struct if_transparent
+{
+};
+template<typename Functor, typename Key>
+struct if_transparent<Functor, Key, void_t<typename Functor::is_transparent>>
+{
+    typedef Key type;
+};
+
 template<typename Result, typename Functor>
 struct functor_storage : Functor
 {
@@ -103,6 +128,16 @@ struct KeyOrValueHasher : functor_storage<size_t, hasher>
     {
         return static_cast<const hasher_storage &>(*this)(value.first);
     }
+    template<typename Key, typename = typename if_transparent<hasher, Key>::type>
+    size_t operator()(const Key & key)
+    {
+        return static_cast<hasher_storage &>(*this)(key);
+    }
+    template<typename Key, typename = typename if_transparent<hasher, Key>::type>
+    size_t operator()(const Key & key) const
+    {
+        return static_cast<const hasher_storage &>(*this)(key);
+    }
 };
 template<typename key_type, typename value_type, typename key_equal>
 struct KeyOrValueEquality : functor_storage<bool, key_equal>
@@ -154,6 +189,11 @@ struct KeyOrValueEquality : functor_storage<bool, key_equal>
     {
         return static_cast<equality_storage &>(*this)(lhs.first, rhs.first);
     }
+    template<typename Key, typename = typename if_transparent<key_equal, Key>::type>
+    bool operator()(const Key & lhs, const value_type & rhs)
+    {
+        return static_cast<equality_storage &>(*this)(lhs, rhs.first);
+    }
 };
 static constexpr int8_t min_lookups = 4;
 template<typename T>
@@ -263,13 +303,6 @@ inline size_t next_power_of_two(size_t i)
     return i;
 }
 
-// template<typename...> using void_t = void;
-template <typename...>
-struct voider { using type = void; };
-
-template <typename... Ts>
-using void_t = typename voider<Ts...>::type;
-
 template<typename T, typename = void>
 struct HashPolicySelector
 {
@@ -281,12 +314,14 @@ struct HashPolicySelector<T, void_t<typename T::hash_policy>>
     typedef typename T::hash_policy type;
 };
 
-template<typename T, typename FindKey, typename ArgumentHash, typename Hasher, typename ArgumentEqual, typename Equal, typename ArgumentAlloc, typename EntryAlloc>
+// Layout decides how the slots are stored, see aos_layout
+template<typename T, typename FindKey, typename ArgumentHash, typename Hasher, typename ArgumentEqual, typename Equal, typename ArgumentAlloc, typename EntryAlloc, typename Layout = aos_layout>
 class sherwood_v3_table : private EntryAlloc, private Hasher, private Equal
 {
     using Entry = detailv3::sherwood_v3_entry<T>;
     using AllocatorTraits = std::allocator_traits<EntryAlloc>;
-    using EntryPointer = typename AllocatorTraits::pointer;
+    using Slots = typename Layout::template slots<T, EntryAlloc>;
+    using EntryPointer = typename Slots::pointer;
     struct convertible_to_iterator;
 
 public:
@@ -543,18 +578,11 @@ public:
 
     iterator find(const FindKey & key)
     {
-        size_t index = hash_policy.index_for_hash(hash_object(key), num_slots_minus_one);
-        EntryPointer it = entries + ptrdiff_t(index);
-        for (int8_t distance = 0; it->distance_from_desired >= distance; ++distance, ++it)
-        {
-            if (compares_equal(key, it->value))
-                return { it };
-        }
-        return end();
+        return find_impl(key);
     }
     const_iterator find(const FindKey & key) const
     {
-        return const_cast<sherwood_v3_table *>(this)->find(key);
+        return const_cast<sherwood_v3_table *>(this)->find_impl(key);
     }
     size_t count(const FindKey & key) const
     {
@@ -562,25 +590,77 @@ public:
     }
     std::pair<iterator, iterator> equal_range(const FindKey & key)
     {
-        iterator found = find(key);
-        if (found == end())
-            return { found, found };
-        else
-            return { found, std::next(found) };
+        return equal_range_impl(key);
     }
     std::pair<const_iterator, const_iterator> equal_range(const FindKey & key) const
     {
-        const_iterator found = find(key);
-        if (found == end())
-            return { found, found };
-        else
-            return { found, std::next(found) };
+        return const_cast<sherwood_v3_table *>(this)->equal_range_impl(key);
+    }
+
+    // looks up every key of [keys_begin, keys_end) and writes an iterator
+    // to out for each, end() if the key isn't there. The home slot of a key
+    // is hashed and prefetched prefetch_distance keys before it is probed,
+    // so that many cache misses are in flight at once instead of one per
+    // find. KeyIt has to be a forward iterator.
+    template<typename KeyIt, typename OutIt>
+    OutIt find_batch(KeyIt keys_begin, KeyIt keys_end, OutIt out)
+    {
+        static constexpr size_t prefetch_distance = 16;
+        EntryPointer home[prefetch_distance];
+        KeyIt ahead = keys_begin;
+        size_t in_flight = 0;
+        for (; in_flight < prefetch_distance && ahead != keys_end; ++in_flight, ++ahead)
+            home[in_flight] = prefetch_home(*ahead);
+        for (size_t i = 0; keys_begin != keys_end; ++keys_begin, ++out, i = (i + 1) % prefetch_distance)
+        {
+            *out = find_from(home[i], *keys_begin);
+            if (ahead != keys_end)
+            {
+                home[i] = prefetch_home(*ahead);
+                ++ahead;
+            }
+        }
+        return out;
+    }
+    template<typename KeyIt, typename OutIt>
+    OutIt find_batch(KeyIt keys_begin, KeyIt keys_end, OutIt out) const
+    {
+        return const_cast<sherwood_v3_table *>(this)->find_batch(keys_begin, keys_end, out);
+    }
+
+    // lookups by any type that the hasher and the comparator take, if both
+    // of them are transparent: a std::string key can be found with a
+    // const char * or a string_view without building a std::string
+    template<typename Key, typename = typename if_transparent<ArgumentHash, typename if_transparent<ArgumentEqual, Key>::type>::type>
+    iterator find(const Key & key)
+    {
+        return find_impl(key);
+    }
+    template<typename Key, typename = typename if_transparent<ArgumentHash, typename if_transparent<ArgumentEqual, Key>::type>::type>
+    const_iterator find(const Key & key) const
+    {
+        return const_cast<sherwood_v3_table *>(this)->find_impl(key);
+    }
+    template<typename Key, typename = typename if_transparent<ArgumentHash, typename if_transparent<ArgumentEqual, Key>::type>::type>
+    size_t count(const Key & key) const
+    {
+        return find(key) == end() ? 0 : 1;
+    }
+    template<typename Key, typename = typename if_transparent<ArgumentHash, typename if_transparent<ArgumentEqual, Key>::type>::type>
+    std::pair<iterator, iterator> equal_range(const Key & key)
+    {
+        return equal_range_impl(key);
+    }
+    template<typename Key, typename = typename if_transparent<ArgumentHash, typename if_transparent<ArgumentEqual, Key>::type>::type>
+    std::pair<const_iterator, const_iterator> equal_range(const Key & key) const
+    {
+        return const_cast<sherwood_v3_table *>(this)->equal_range_impl(key);
     }
 
     template<typename Key, typename... Args>
     std::pair<iterator, bool> emplace(Key && key, Args &&... args)
     {
-        size_t index = hash_policy.index_for_hash(hash_object(key), num_slots_minus_one);
+        size_t index = index_for_key(key);
         EntryPointer current_entry = entries + ptrdiff_t(index);
         int8_t distance_from_desired = 0;
         for (; current_entry->distance_from_desired >= distance_from_desired; ++current_entry, ++distance_from_desired)
@@ -637,28 +717,7 @@ public:
         auto new_prime_index = hash_policy.next_size_over(num_buckets);
         if (num_buckets == bucket_count())
             return;
-        int8_t new_max_lookups = compute_max_lookups(num_buckets);
-        EntryPointer new_buckets(AllocatorTraits::allocate(*this, num_buckets + new_max_lookups));
-        EntryPointer special_end_item = new_buckets + static_cast<ptrdiff_t>(num_buckets + new_max_lookups - 1);
-        for (EntryPointer it = new_buckets; it != special_end_item; ++it)
-            it->distance_from_desired = -1;
-        special_end_item->distance_from_desired = Entry::special_end_value;
-        std::swap(entries, new_buckets);
-        std::swap(num_slots_minus_one, num_buckets);
-        --num_slots_minus_one;
-        hash_policy.commit(new_prime_index);
-        int8_t old_max_lookups = max_lookups;
-        max_lookups = new_max_lookups;
-        num_elements = 0;
-        for (EntryPointer it = new_buckets, end = it + static_cast<ptrdiff_t>(num_buckets + old_max_lookups); it != end; ++it)
-        {
-            if (it->has_value())
-            {
-                emplace(std::move(it->value));
-                it->destroy_value();
-            }
-        }
-        deallocate_data(new_buckets, num_buckets, old_max_lookups);
+        rehash_to(num_buckets, new_prime_index);
     }
 
     void reserve(size_t num_elements)
@@ -668,6 +727,59 @@ public:
             rehash(required_buckets);
     }
 
+    // an array for a later rehash, the first initialized slots of it are
+    // marked empty. The caller owns it and has to give it back to
+    // deallocate_prepared or to rehash
+    struct prepared_array
+    {
+        EntryPointer entries = nullptr;
+        size_t num_buckets = 0;
+        size_t initialized = 0;
+    };
+
+    // allocates the array that rehash(num_buckets) will need and marks up
+    // to count more of its slots empty on every call, the rehash then only
+    // initializes what is left. Lets incremental_flat_hash_map spread the
+    // cost of growing over the inserts that come before it.
+    void prepare_rehash(prepared_array & prepared, size_t num_buckets, size_t count)
+    {
+        hash_policy.next_size_over(num_buckets);
+        if (prepared.entries && prepared.num_buckets != num_buckets)
+            deallocate_prepared(prepared);
+        if (!prepared.entries)
+        {
+            prepared.entries = Slots::allocate(*this, num_buckets + compute_max_lookups(num_buckets));
+            prepared.num_buckets = num_buckets;
+            prepared.initialized = 0;
+        }
+        initialize_prepared(prepared, count);
+    }
+    // rehash(num_buckets) into the prepared array if it has the size that
+    // the rehash needs, otherwise the array is freed
+    void rehash(size_t num_buckets, prepared_array & prepared)
+    {
+        size_t new_buckets = std::max(num_buckets, static_cast<size_t>(std::ceil(num_elements / static_cast<double>(_max_load_factor))));
+        auto new_prime_index = hash_policy.next_size_over(new_buckets);
+        if (!prepared.entries || prepared.num_buckets != new_buckets || new_buckets == bucket_count())
+        {
+            deallocate_prepared(prepared);
+            rehash(num_buckets);
+            return;
+        }
+        initialize_prepared(prepared, new_buckets + compute_max_lookups(new_buckets));
+        EntryPointer new_entries = prepared.entries;
+        prepared.entries = nullptr;
+        rehash_into(new_entries, new_buckets, new_prime_index);
+    }
+    void deallocate_prepared(prepared_array & prepared)
+    {
+        if (prepared.entries)
+        {
+            Slots::deallocate(*this, prepared.entries, prepared.num_buckets + compute_max_lookups(prepared.num_buckets));
+            prepared.entries = nullptr;
+        }
+    }
+
     // the return value is a type that can be converted to an iterator
     // the reason for doing this is that it's not free to find the
     // iterator pointing at the next element. if you care about the
@@ -712,16 +824,56 @@ public:
         return { to_return };
     }
 
-    size_t erase(const FindKey & key)
+    // erases every element for which pred(value) returns true and returns
+    // how many that were. erase(iterator) shifts the rest of the cluster back
+    // by one slot per erased element, this goes over the array once and
+    // moves every element that stays at most once, as far back as it can go
+    template<typename Predicate>
+    size_t erase_if(Predicate pred)
     {
-        auto found = find(key);
-        if (found == end())
-            return 0;
-        else
+        size_t num_erased = 0;
+        // the first slot that an element at or after it can move back to
+        EntryPointer free_slot = entries;
+        EntryPointer it = entries;
+        EntryPointer end = it + static_cast<ptrdiff_t>(num_slots_minus_one + max_lookups);
+        try
         {
-            erase(found);
-            return 1;
+            for (; it != end; ++it)
+            {
+                if (it->is_empty())
+                    free_slot = it + ptrdiff_t(1);
+                else if (pred(it->value))
+                {
+                    it->destroy_value();
+                    ++num_erased;
+                }
+                else if (free_slot == it)
+                    ++free_slot;
+                else
+                    free_slot = shift_back(it, free_slot);
+            }
         }
+        catch(...)
+        {
+            // the rest of the cluster must not stay behind an empty slot
+            for (; it != end && it->has_value(); ++it)
+                free_slot = shift_back(it, free_slot);
+            num_elements -= num_erased;
+            throw;
+        }
+        num_elements -= num_erased;
+        return num_erased;
+    }
+
+    size_t erase(const FindKey & key)
+    {
+        return erase_impl(key);
+    }
+    // iterators must keep going to the overloads above
+    template<typename Key, typename = typename if_transparent<ArgumentHash, typename if_transparent<ArgumentEqual, Key>::type>::type, typename = typename std::enable_if<!std::is_convertible<const Key &, const_iterator>::value>::type>
+    size_t erase(const Key & key)
+    {
+        return erase_impl(key);
     }
 
     void clear()
@@ -767,7 +919,7 @@ public:
     }
     size_t bucket(const FindKey & key) const
     {
-        return hash_policy.index_for_hash(hash_object(key), num_slots_minus_one);
+        return index_for_key(key);
     }
     float load_factor() const
     {
@@ -792,12 +944,16 @@ public:
     }
 
 private:
-    EntryPointer entries = Entry::empty_default_table();
+    EntryPointer entries = Slots::empty_default_table();
     size_t num_slots_minus_one = 0;
     typename HashPolicySelector<ArgumentHash>::type hash_policy;
     int8_t max_lookups = detailv3::min_lookups - 1;
     float _max_load_factor = 0.5f;
     size_t num_elements = 0;
+    // 0 while the hash is used as it is, see grow_after_probe_limit
+    size_t hash_seed = 0;
+    int8_t num_reseeds = 0;
+    static constexpr int8_t max_reseeds = 3;
 
     static int8_t compute_max_lookups(size_t num_buckets)
     {
@@ -823,6 +979,8 @@ private:
         swap(num_elements, other.num_elements);
         swap(max_lookups, other.max_lookups);
         swap(_max_load_factor, other._max_load_factor);
+        swap(hash_seed, other.hash_seed);
+        swap(num_reseeds, other.num_reseeds);
     }
 
     template<typename Key, typename... Args>
@@ -831,7 +989,10 @@ private:
         using std::swap;
         if (num_slots_minus_one == 0 || distance_from_desired == max_lookups || num_elements + 1 > (num_slots_minus_one + 1) * static_cast<double>(_max_load_factor))
         {
-            grow();
+            if (num_slots_minus_one != 0 && distance_from_desired == max_lookups)
+                grow_after_probe_limit();
+            else
+                grow();
             return emplace(std::forward<Key>(key), std::forward<Args>(args)...);
         }
         else if (current_entry->is_empty())
@@ -864,35 +1025,173 @@ private:
                 if (distance_from_desired == max_lookups)
                 {
                     swap(to_insert, result.current->value);
-                    grow();
+                    grow_after_probe_limit();
                     return emplace(std::move(to_insert));
                 }
             }
         }
     }
 
+    // moves everything to a new array of num_buckets, which may be the
+    // current size
+    template<typename PrimeIndex>
+    void rehash_to(size_t num_buckets, PrimeIndex new_prime_index)
+    {
+        int8_t new_max_lookups = compute_max_lookups(num_buckets);
+        EntryPointer new_buckets(Slots::allocate(*this, num_buckets + new_max_lookups));
+        EntryPointer special_end_item = new_buckets + static_cast<ptrdiff_t>(num_buckets + new_max_lookups - 1);
+        for (EntryPointer it = new_buckets; it != special_end_item; ++it)
+            it->distance_from_desired = -1;
+        special_end_item->distance_from_desired = Slots::special_end_value;
+        rehash_into(new_buckets, num_buckets, new_prime_index);
+    }
+    // moves everything to new_buckets, an initialized array of num_buckets
+    template<typename PrimeIndex>
+    void rehash_into(EntryPointer new_buckets, size_t num_buckets, PrimeIndex new_prime_index)
+    {
+        if (num_buckets != bucket_count())
+            num_reseeds = 0;
+        int8_t new_max_lookups = compute_max_lookups(num_buckets);
+        std::swap(entries, new_buckets);
+        std::swap(num_slots_minus_one, num_buckets);
+        --num_slots_minus_one;
+        hash_policy.commit(new_prime_index);
+        int8_t old_max_lookups = max_lookups;
+        max_lookups = new_max_lookups;
+        num_elements = 0;
+        for (EntryPointer it = new_buckets, end = it + static_cast<ptrdiff_t>(num_buckets + old_max_lookups); it != end; ++it)
+        {
+            if (it->has_value())
+            {
+                emplace(std::move(it->value));
+                it->destroy_value();
+            }
+        }
+        deallocate_data(new_buckets, num_buckets, old_max_lookups);
+    }
+
     void grow()
     {
         rehash(std::max(size_t(4), 2 * bucket_count()));
     }
 
+    // A probe limit hit at a low load factor means that the hash piles the
+    // keys up in a few places, and doubling the table often keeps the pile:
+    // with fibonacci_hash_policy, keys whose hashes times the golden ratio
+    // agree in the high bits collide at every size, with the power of two
+    // and prime policies so do hashes that differ by a multiple of the
+    // size. So remix the hash with a new seed and rehash at the same size.
+    // That's tried max_reseeds times per size, then the table grows anyway,
+    // the hasher may return the same hash for many keys.
+    void grow_after_probe_limit()
+    {
+        if (num_reseeds >= max_reseeds || num_elements >= (num_slots_minus_one + 1) * static_cast<double>(_max_load_factor) / 2)
+        {
+            grow();
+            return;
+        }
+        ++num_reseeds;
+        hash_seed = murmur_mix(hash_seed + 0x9e3779b97f4a7c15ull + reinterpret_cast<size_t>(std::addressof(entries->distance_from_desired))) | 1;
+        size_t num_buckets = bucket_count();
+        auto prime_index = hash_policy.next_size_over(num_buckets);
+        rehash_to(num_buckets, prime_index);
+    }
+
     void deallocate_data(EntryPointer begin, size_t num_slots_minus_one, int8_t max_lookups)
     {
-        if (begin != Entry::empty_default_table())
+        if (begin != Slots::empty_default_table())
         {
-            AllocatorTraits::deallocate(*this, begin, num_slots_minus_one + max_lookups + 1);
+            Slots::deallocate(*this, begin, num_slots_minus_one + max_lookups + 1);
+        }
+    }
+
+    static void initialize_prepared(prepared_array & prepared, size_t count)
+    {
+        size_t num_slots = prepared.num_buckets + compute_max_lookups(prepared.num_buckets);
+        size_t end = prepared.initialized + std::min(count, num_slots - prepared.initialized);
+        for (; prepared.initialized != end; ++prepared.initialized)
+        {
+            EntryPointer it = prepared.entries + static_cast<ptrdiff_t>(prepared.initialized);
+            it->distance_from_desired = prepared.initialized == num_slots - 1 ? Slots::special_end_value : -1;
         }
     }
 
     void reset_to_empty_state()
     {
         deallocate_data(entries, num_slots_minus_one, max_lookups);
-        entries = Entry::empty_default_table();
+        entries = Slots::empty_default_table();
         num_slots_minus_one = 0;
         hash_policy.reset();
         max_lookups = detailv3::min_lookups - 1;
     }
 
+    template<typename Key>
+    size_t index_for_key(const Key & key) const
+    {
+        size_t hash = hash_object(key);
+        if (hash_seed)
+            hash = murmur_mix(hash ^ hash_seed);
+        return hash_policy.index_for_hash(hash, num_slots_minus_one);
+    }
+    template<typename Key>
+    iterator find_impl(const Key & key)
+    {
+        return find_from(entries + ptrdiff_t(index_for_key(key)), key);
+    }
+    template<typename Key>
+    EntryPointer prefetch_home(const Key & key)
+    {
+        EntryPointer home = entries + ptrdiff_t(index_for_key(key));
+        SKA_PREFETCH(std::addressof(home->distance_from_desired));
+        return home;
+    }
+    // probes from the home slot of the key
+    template<typename Key>
+    iterator find_from(EntryPointer it, const Key & key)
+    {
+        for (int8_t distance = 0; it->distance_from_desired >= distance; ++distance, ++it)
+        {
+            if (compares_equal(key, it->value))
+                return { it };
+        }
+        return end();
+    }
+    template<typename Key>
+    std::pair<iterator, iterator> equal_range_impl(const Key & key)
+    {
+        iterator found = find_impl(key);
+        if (found == end())
+            return { found, found };
+        else
+            return { found, std::next(found) };
+    }
+    template<typename Key>
+    size_t erase_impl(const Key & key)
+    {
+        auto found = find_impl(key);
+        if (found == end())
+            return 0;
+        else
+        {
+            erase(found);
+            return 1;
+        }
+    }
+
+    // moves the element at it to its desired slot, or to free_slot if that
+    // is further along, and returns the slot after it
+    EntryPointer shift_back(EntryPointer it, EntryPointer free_slot)
+    {
+        EntryPointer desired = it - static_cast<ptrdiff_t>(it->distance_from_desired);
+        EntryPointer target = std::max(desired, free_slot);
+        if (target != it)
+        {
+            target->emplace(static_cast<int8_t>(target - desired), std::move(it->value));
+            it->destroy_value();
+        }
+        return target + ptrdiff_t(1);
+    }
+
     template<typename U>
     size_t hash_object(const U & key)
     {
@@ -1299,7 +1598,38 @@ private:
     int8_t shift = 63;
 };
 
-template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> > >
+// The slots of the table are an array of sherwood_v3_entry: the distance
+// from the desired slot followed by the value. A layout gives the table
+// slots<T, EntryAlloc> with a pointer type that walks the slots and whose
+// operator-> has distance_from_desired, value and the methods of
+// sherwood_v3_entry, the allocation functions, the static table of the
+// empty map and special_end_value. soa_layout is the other one.
+struct aos_layout
+{
+    template<typename T, typename EntryAlloc>
+    struct slots
+    {
+        using Entry = detailv3::sherwood_v3_entry<T>;
+        using AllocatorTraits = std::allocator_traits<EntryAlloc>;
+        using pointer = typename AllocatorTraits::pointer;
+        static constexpr int8_t special_end_value = Entry::special_end_value;
+
+        static pointer empty_default_table()
+        {
+            return Entry::empty_default_table();
+        }
+        static pointer allocate(EntryAlloc & alloc, size_t num_slots)
+        {
+            return AllocatorTraits::allocate(alloc, num_slots);
+        }
+        static void deallocate(EntryAlloc & alloc, pointer begin, size_t num_slots)
+        {
+            AllocatorTraits::deallocate(alloc, begin, num_slots);
+        }
+    };
+};
+
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> >, typename Layout = aos_layout>
 class flat_hash_map
         : public detailv3::sherwood_v3_table
         <
@@ -1310,7 +1640,8 @@ class flat_hash_map
             E,
             detailv3::KeyOrValueEquality<K, std::pair<K, V>, E>,
             A,
-            typename std::allocator_traits<A>::template rebind_alloc<detailv3::sherwood_v3_entry<std::pair<K, V>>>
+            typename std::allocator_traits<A>::template rebind_alloc<detailv3::sherwood_v3_entry<std::pair<K, V>>>,
+            Layout
         >
 {
     using Table = detailv3::sherwood_v3_table
@@ -1322,7 +1653,8 @@ class flat_hash_map
         E,
         detailv3::KeyOrValueEquality<K, std::pair<K, V>, E>,
         A,
-        typename std::allocator_traits<A>::template rebind_alloc<detailv3::sherwood_v3_entry<std::pair<K, V>>>
+        typename std::allocator_traits<A>::template rebind_alloc<detailv3::sherwood_v3_entry<std::pair<K, V>>>,
+        Layout
     >;
 public:
 
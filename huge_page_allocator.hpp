@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+
+namespace ska
+{
+
+enum huge_page_flags : unsigned
+{
+    // transparent huge pages: an anonymous mapping aligned to 2MB, with
+    // madvise(MADV_HUGEPAGE), which works with THP set to "madvise"
+    huge_page_madvise = 0,
+    // MAP_HUGETLB from the reserved pool (vm.nr_hugepages), falls back to
+    // huge_page_madvise if the pool can't satisfy the mapping
+    huge_page_hugetlb = 1,
+    // MAP_POPULATE: fault in all of the mapping in mmap
+    huge_page_populate = 2,
+    // touch every page with one thread per core after mmap, so the page
+    // faults of a multi-GB table are taken in parallel
+    huge_page_prefault = 4,
+};
+
+// An allocator for the entry arrays of sherwood_v3_table (flat_hash_map,
+// flat_hash_set and the other ska tables) that maps allocations of MinBytes
+// or more directly with mmap, backed by huge pages, and leaves the smaller
+// ones to operator new. One 2MB page holds what would be 512 4K pages, so
+// random probes into a big table miss the TLB far less often, and first
+// touch takes one page fault per 2MB.
+//
+// Stateless: all instances compare equal, Flags and MinBytes are part of
+// the type.
+//
+//     ska::flat_hash_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+//                        ska::huge_page_allocator<std::pair<uint64_t, uint64_t>, ska::huge_page_prefault>> map;
+template<typename T, unsigned Flags = huge_page_madvise, size_t MinBytes = (size_t(1) << 21)>
+struct huge_page_allocator
+{
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef huge_page_allocator<U, Flags, MinBytes> other;
+    };
+
+    static constexpr size_t huge_page_size = size_t(1) << 21;
+
+    huge_page_allocator() = default;
+    template<typename U>
+    huge_page_allocator(const huge_page_allocator<U, Flags, MinBytes> &)
+    {
+    }
+
+    T * allocate(size_t n)
+    {
+        if (n > (size_t(-1) - 2 * huge_page_size) / sizeof(T))
+            throw std::bad_alloc();
+        size_t bytes = n * sizeof(T);
+        if (bytes < MinBytes)
+            return static_cast<T *>(::operator new(bytes));
+        return static_cast<T *>(map(round_up(bytes)));
+    }
+    void deallocate(T * ptr, size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < MinBytes)
+            ::operator delete(ptr);
+        else
+            munmap(ptr, round_up(bytes));
+    }
+
+    friend bool operator==(const huge_page_allocator &, const huge_page_allocator &)
+    {
+        return true;
+    }
+    friend bool operator!=(const huge_page_allocator &, const huge_page_allocator &)
+    {
+        return false;
+    }
+
+private:
+    static size_t round_up(size_t bytes)
+    {
+        return (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+    }
+
+    static void * map(size_t bytes)
+    {
+        int populate = 0;
+#ifdef MAP_POPULATE
+        if (Flags & huge_page_populate)
+            populate = MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+        if (Flags & huge_page_hugetlb)
+        {
+            void * ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+            if (ptr != MAP_FAILED)
+                return prefault(ptr, bytes);
+        }
+#endif
+        // mmap only aligns to 4K: map 2MB more and cut off both ends, or
+        // the first and last 2MB of the table can't be huge pages
+        size_t padded = bytes + huge_page_size;
+        void * mapped = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            throw std::bad_alloc();
+        uintptr_t begin = reinterpret_cast<uintptr_t>(mapped);
+        uintptr_t aligned = (begin + huge_page_size - 1) & ~uintptr_t(huge_page_size - 1);
+        if (aligned != begin)
+            munmap(mapped, aligned - begin);
+        if (aligned + bytes != begin + padded)
+            munmap(reinterpret_cast<void *>(aligned + bytes), begin + padded - aligned - bytes);
+        void * ptr = reinterpret_cast<void *>(aligned);
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+        // MAP_POPULATE would have faulted in 4K pages before the madvise
+        if (populate)
+            madvise_populate(ptr, bytes);
+        return prefault(ptr, bytes);
+    }
+
+    static void madvise_populate(void * ptr, size_t bytes)
+    {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(ptr, bytes, MADV_POPULATE_WRITE) == 0)
+            return;
+#endif
+        touch(static_cast<char *>(ptr), bytes);
+    }
+
+    static void * prefault(void * ptr, size_t bytes)
+    {
+        if (!(Flags & huge_page_prefault))
+            return ptr;
+        size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t chunk = round_up(bytes / num_threads + 1);
+        std::vector<std::thread> threads;
+        char * begin = static_cast<char *>(ptr);
+        for (size_t offset = chunk; offset < bytes; offset += chunk)
+            threads.emplace_back(touch, begin + offset, std::min(chunk, bytes - offset));
+        touch(begin, std::min(chunk, bytes));
+        for (std::thread & thread : threads)
+            thread.join();
+        return ptr;
+    }
+
+    // a write per 4K page, the memory is still all zeroes
+    static void touch(char * begin, size_t bytes)
+    {
+        for (size_t offset = 0; offset < bytes; offset += 4096)
+            static_cast<volatile char *>(begin)[offset] = 0;
+    }
+};
+
+} // end namespace ska
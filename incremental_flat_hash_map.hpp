@@ -0,0 +1,369 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <iterator>
+
+#include "flat_hash_map.hpp"
+
+namespace ska
+{
+
+// A flat_hash_map that grows without moving all of its elements in one
+// call. When the table is about to grow, it becomes the old table, a new
+// table of twice the size takes its place, and from then on every insert
+// and erase moves at most migrate_step elements from the old table to the
+// new one. Lookups consult both tables until the old one is empty, then it
+// is freed.
+//
+// The new table is big enough to take every element of the old one plus
+// everything inserted before the migration ends, so it doesn't grow in
+// the middle of one. Its array isn't initialized in one go either: the
+// inserts shortly before a growth each mark prepare_factor * migrate_step
+// slots of it empty (see sherwood_v3_table::prepare_rehash), so it's ready
+// when the growth comes. The map holds that array until then, a plain
+// flat_hash_map doesn't pay for it. Two arrays are alive during a
+// migration and while the next one is prepared.
+//
+// Iterators visit the new table, then the old one. Like flat_hash_map,
+// any insert or erase invalidates them, since it may migrate elements.
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> > >
+class incremental_flat_hash_map
+{
+public:
+    using Map = flat_hash_map<K, V, H, E, A>;
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<K, V>;
+    using size_type = size_t;
+
+    template<typename MapIterator, typename ValueType>
+    struct templated_iterator
+    {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = ValueType;
+        using difference_type = std::ptrdiff_t;
+        using pointer = ValueType *;
+        using reference = ValueType &;
+
+        friend bool operator==(const templated_iterator & lhs, const templated_iterator & rhs)
+        {
+            return lhs.current == rhs.current;
+        }
+        friend bool operator!=(const templated_iterator & lhs, const templated_iterator & rhs)
+        {
+            return !(lhs == rhs);
+        }
+
+        templated_iterator & operator++()
+        {
+            ++current;
+            if (current == new_end)
+                current = old_begin;
+            return *this;
+        }
+        templated_iterator operator++(int)
+        {
+            templated_iterator copy(*this);
+            ++*this;
+            return copy;
+        }
+
+        ValueType & operator*() const
+        {
+            return *current;
+        }
+        ValueType * operator->() const
+        {
+            return std::addressof(*current);
+        }
+
+        template<typename OtherIterator, typename OtherValue>
+        operator templated_iterator<OtherIterator, OtherValue>() const
+        {
+            return { current, new_end, old_begin };
+        }
+
+        MapIterator current;
+        MapIterator new_end;
+        MapIterator old_begin;
+    };
+    using iterator = templated_iterator<typename Map::iterator, value_type>;
+    using const_iterator = templated_iterator<typename Map::const_iterator, const value_type>;
+
+    explicit incremental_flat_hash_map(size_t migrate_step = 16)
+        : migrate_step(migrate_step ? migrate_step : 1)
+    {
+    }
+    // the copy prepares its own next array
+    incremental_flat_hash_map(const incremental_flat_hash_map & other)
+        : new_table(other.new_table), migrate_step(other.migrate_step)
+    {
+        new_table.reserve(other.size());
+        new_table.insert(other.old_table.begin(), other.old_table.end());
+    }
+    incremental_flat_hash_map(incremental_flat_hash_map && other) noexcept
+        : migrate_step(other.migrate_step)
+    {
+        swap(other);
+    }
+    incremental_flat_hash_map & operator=(incremental_flat_hash_map other)
+    {
+        swap(other);
+        return *this;
+    }
+    ~incremental_flat_hash_map()
+    {
+        old_table.deallocate_prepared(prepared);
+    }
+
+    iterator begin()
+    {
+        return wrap(new_table.begin());
+    }
+    const_iterator begin() const
+    {
+        return wrap(new_table.begin());
+    }
+    iterator end()
+    {
+        return wrap(old_table.end());
+    }
+    const_iterator end() const
+    {
+        return wrap(old_table.end());
+    }
+
+    iterator find(const K & key)
+    {
+        auto found = new_table.find(key);
+        if (found != new_table.end())
+            return wrap(found);
+        return wrap(old_table.find(key));
+    }
+    const_iterator find(const K & key) const
+    {
+        auto found = new_table.find(key);
+        if (found != new_table.end())
+            return wrap(found);
+        return wrap(old_table.find(key));
+    }
+    size_t count(const K & key) const
+    {
+        return new_table.count(key) + old_table.count(key);
+    }
+
+    V & operator[](const K & key)
+    {
+        iterator found = prepare_insert(key);
+        if (found != end())
+            return found->second;
+        return new_table[key];
+    }
+    V & at(const K & key)
+    {
+        iterator found = find(key);
+        if (found == end())
+            throw std::out_of_range("Argument passed to at() was not in the map.");
+        return found->second;
+    }
+    const V & at(const K & key) const
+    {
+        const_iterator found = find(key);
+        if (found == end())
+            throw std::out_of_range("Argument passed to at() was not in the map.");
+        return found->second;
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(const K & key, Args &&... args)
+    {
+        iterator found = prepare_insert(key);
+        if (found != end())
+            return { found, false };
+        return { wrap(new_table.emplace(key, std::forward<Args>(args)...).first), true };
+    }
+    std::pair<iterator, bool> insert(const value_type & value)
+    {
+        return emplace(value.first, value.second);
+    }
+    template<typename It>
+    void insert(It begin, It end)
+    {
+        for (; begin != end; ++begin)
+            insert(*begin);
+    }
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const K & key, M && m)
+    {
+        iterator found = prepare_insert(key);
+        if (found != end())
+        {
+            found->second = std::forward<M>(m);
+            return { found, false };
+        }
+        return { wrap(new_table.emplace(key, std::forward<M>(m)).first), true };
+    }
+
+    size_t erase(const K & key)
+    {
+        migrate(migrate_step);
+        if (new_table.erase(key))
+            return 1;
+        auto found = old_table.find(key);
+        if (found == old_table.end())
+            return 0;
+        erase_old(found);
+        finish_if_migrated();
+        return 1;
+    }
+
+    void clear()
+    {
+        new_table.clear();
+        old_table.clear();
+        finish_if_migrated();
+    }
+    // finishes the migration first, so that the whole table is sized for
+    // num_elements
+    void reserve(size_t num_elements)
+    {
+        migrate(old_table.size());
+        new_table.reserve(num_elements);
+    }
+    void swap(incremental_flat_hash_map & other)
+    {
+        using std::swap;
+        new_table.swap(other.new_table);
+        old_table.swap(other.old_table);
+        swap(old_cursor, other.old_cursor);
+        swap(migrate_step, other.migrate_step);
+        swap(prepared, other.prepared);
+    }
+
+    size_t size() const
+    {
+        return new_table.size() + old_table.size();
+    }
+    bool empty() const
+    {
+        return size() == 0;
+    }
+    size_t bucket_count() const
+    {
+        return new_table.bucket_count() + old_table.bucket_count();
+    }
+    // true while elements are left in the old table
+    bool migrating() const
+    {
+        return old_table.bucket_count() != 0;
+    }
+
+    // moves up to count elements, or all of them, to the new table
+    void migrate(size_t count)
+    {
+        if (!migrating())
+            return;
+        for (; count && old_cursor != old_table.end(); --count)
+        {
+            new_table.emplace(std::move(*old_cursor));
+            old_cursor = old_table.erase(old_cursor);
+        }
+        finish_if_migrated();
+    }
+
+private:
+    Map new_table;
+    Map old_table;
+    // elements before it have been moved, erase keeps it at the next one
+    typename Map::iterator old_cursor = old_table.end();
+    size_t migrate_step;
+    // the array that the old table rehashes into when it becomes the new
+    // table, see prepare_next_array
+    typename Map::prepared_array prepared;
+
+    iterator wrap(typename Map::iterator it)
+    {
+        if (it == new_table.end())
+            it = old_table.begin();
+        return { it, new_table.end(), old_table.begin() };
+    }
+    const_iterator wrap(typename Map::const_iterator it) const
+    {
+        if (it == new_table.end())
+            it = old_table.begin();
+        return { it, new_table.end(), old_table.begin() };
+    }
+
+    // slots of the next array that each insert marks empty, per element
+    // that it migrates
+    static constexpr size_t prepare_factor = 4;
+
+    // migrates a step and looks for the key in both tables. If it's not
+    // there and the new table would have to grow for it, starts a
+    // migration, the caller then inserts into the new table. Otherwise,
+    // between migrations, prepares a step of the next array in the old
+    // table, which becomes the new table when the migration starts.
+    iterator prepare_insert(const K & key)
+    {
+        migrate(migrate_step);
+        iterator found = find(key);
+        if (found != end())
+            return found;
+        if (new_table.bucket_count() && new_table.size() + 1 > new_table.bucket_count() * static_cast<double>(new_table.max_load_factor()))
+            start_migration();
+        else if (!migrating() && new_table.bucket_count())
+            prepare_next_array();
+        return end();
+    }
+
+    // Prepares a step of the next array once the growth is close enough
+    // that the steps will finish it twice over before then. Starting
+    // right after the migration would keep the array around for longer
+    // and, if no growth comes, initialize it for nothing. With a tiny
+    // migrate_step it can't be finished in time, the rest is initialized
+    // when the table grows.
+    void prepare_next_array()
+    {
+        size_t step = prepare_factor * migrate_step;
+        size_t next_buckets = new_table.bucket_count() * 2;
+        double grows_at = new_table.bucket_count() * static_cast<double>(new_table.max_load_factor());
+        if (new_table.size() + 2 * next_buckets / step >= grows_at)
+            old_table.prepare_rehash(prepared, next_buckets, step);
+    }
+
+    void start_migration()
+    {
+        // only if migrate_step is so small that the new table filled up
+        // before the old one emptied
+        migrate(old_table.size());
+        old_table.swap(new_table);
+        new_table.max_load_factor(old_table.max_load_factor());
+        new_table.rehash(old_table.bucket_count() * 2, prepared);
+        old_cursor = old_table.begin();
+    }
+
+    void erase_old(typename Map::iterator it)
+    {
+        // the erase shifts the next element back into the cursor's slot
+        if (it == old_cursor)
+            old_cursor = old_table.erase(it);
+        else
+            old_table.erase(it);
+    }
+
+    // frees the old array once it's empty. shrink_to_fit doesn't walk the
+    // array like the destructor would.
+    void finish_if_migrated()
+    {
+        if (migrating() && old_table.empty())
+        {
+            old_table.shrink_to_fit();
+            old_cursor = old_table.end();
+        }
+    }
+};
+
+} // end namespace ska
@@ -40,9 +40,15 @@ this program; if not, write to the Free Software Foundation, Inc.,
 #include <algorithm>
 #include <sys/types.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "fast_hash.hpp"
 
 typedef unsigned char uchar;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 typedef int32_t int32;
 typedef intptr_t intptr;
 typedef unsigned long int ulint;
@@ -51,7 +57,10 @@ typedef unsigned long int ulint;
 
 #define lf_free(X) free(X)
 #define lf_alloc(X) malloc(X)
+#define lf_zalloc(X) calloc(1, X)
+#define LF_CACHE_LINE_SIZE 64
 #define lf_max(a,b) ((a) > (b) ? (a) : (b))
+#define array_elements(A) ((size_t)(sizeof(A) / sizeof(A[0])))
 #define lf_thread_yield sched_yield()
 
 const uchar bits_reverse_table[256] = {
@@ -167,7 +176,7 @@ static const ulong dynarray_idxes_in_prev_level[LF_DYNARRAY_LEVELS] = {
 
 /*
   Returns a valid lvalue pointer to the element number 'idx'.
-  Allocates memory if necessary.
+  Allocates memory if necessary, new elements are zero-filled.
 */
 void *lf_dynarray_lvalue(LF_DYNARRAY *array, uint idx) {
   void *ptr;
@@ -179,7 +188,7 @@ void *lf_dynarray_lvalue(LF_DYNARRAY *array, uint idx) {
   idx -= dynarray_idxes_in_prev_levels[i];
   for (; i > 0; i--) {
     if (!(ptr = *ptr_ptr)) {
-      void *alloc = lf_alloc(LF_DYNARRAY_LEVEL_LENGTH * sizeof(void *));
+      void *alloc = lf_zalloc(LF_DYNARRAY_LEVEL_LENGTH * sizeof(void *));
       if (unlikely(!alloc)) {
         return (NULL);
       }
@@ -196,7 +205,7 @@ void *lf_dynarray_lvalue(LF_DYNARRAY *array, uint idx) {
   if (!(ptr = *ptr_ptr)) {
     uchar *alloc, *data;
     alloc = static_cast<uchar *>(
-        lf_alloc(LF_DYNARRAY_LEVEL_LENGTH * array->size_of_element +
+        lf_zalloc(LF_DYNARRAY_LEVEL_LENGTH * array->size_of_element +
                       lf_max(array->size_of_element, sizeof(void *))));
     if (unlikely(!alloc)) {
       return (NULL);
@@ -292,17 +301,40 @@ int lf_dynarray_iterate(LF_DYNARRAY *array, lf_dynarray_func func, void *arg) {
 */
 #define LF_PINBOX_PINS 4
 #define LF_PURGATORY_SIZE 100
-#define LF_PINBOX_MAX_PINS 65536
+/*
+  pinstack_top_ver keeps the index of the top of the free stack in the low
+  32 bits and the version in the high 32 bits, so the number of LF_PINS
+  is only limited by the index width (index 0 means "NULL pointer").
+*/
+#define LF_PINBOX_MAX_PINS (1ULL << 32)
+#define LF_PINMAP_BITS 64
+
+/*
+  How long the background reclaimer sleeps when no purgatory batch
+  was handed off to it, in microseconds.
+*/
+#define LF_RECLAIMER_SLEEP_US 1000
+
+enum lf_reclaimer_state {
+  LF_RECLAIMER_NONE,
+  LF_RECLAIMER_RUNNING,
+  LF_RECLAIMER_STOPPING
+};
 
 typedef void lf_pinbox_free_func(void *, void *, void *);
 
 typedef struct {
   LF_DYNARRAY pinarray;
+  LF_DYNARRAY pinmap; /* one bit per LF_PINS, set while it is in use */
   lf_pinbox_free_func *free_func;
   void *free_func_arg;
   uint free_ptr_offset;
-  std::atomic<uint32> pinstack_top_ver; /* this is a versioned pointer */
-  std::atomic<uint32> pins_in_array;    /* number of elements in array */
+  std::atomic<uint64> pinstack_top_ver; /* this is a versioned pointer */
+  std::atomic<uint64> pins_in_array;    /* number of elements in array */
+  /* purgatory batches and orphaned purgatories waiting to be scanned */
+  std::atomic<void *> handoff;
+  std::atomic<int> reclaimer_state; /* lf_reclaimer_state */
+  pthread_t reclaimer;
 } LF_PINBOX;
 
 struct LF_PINS {
@@ -311,12 +343,17 @@ struct LF_PINS {
   void *purgatory;
   uint32 purgatory_count;
   std::atomic<uint32> link;
+  /* LF_HASH_MVCC: the version this thread scans a snapshot at, or 0 */
+  std::atomic<uint64> snapshot;
   /* we want sizeof(LF_PINS) to be 64 to avoid false sharing */
-#if SIZEOF_INT * 2 + SIZEOF_CHARP * (LF_PINBOX_PINS + 2) != 64
-  char pad[64 - sizeof(uint32) * 2 - sizeof(void *) * (LF_PINBOX_PINS + 2)];
-#endif
 };
 
+/*
+  Get the next pointer in the purgatory list.
+  Note that next_node is not used to avoid the extra volatile.
+*/
+#define pnext_node(P, X) (*((void **)(((char *)(X)) + (P)->free_ptr_offset)))
+
 /*
   Initialize a pinbox. Normally called from lf_alloc_init.
   See the latter for details.
@@ -326,22 +363,52 @@ void lf_pinbox_init(LF_PINBOX *pinbox, uint free_ptr_offset,
   DBUG_ASSERT(free_ptr_offset % sizeof(void *) == 0);
   static_assert(sizeof(LF_PINS) == 64, "");
   lf_dynarray_init(&pinbox->pinarray, sizeof(LF_PINS));
+  lf_dynarray_init(&pinbox->pinmap, sizeof(std::atomic<uint64>));
   pinbox->pinstack_top_ver = 0;
   pinbox->pins_in_array = 0;
+  pinbox->handoff = NULL;
+  pinbox->reclaimer_state = LF_RECLAIMER_NONE;
   pinbox->free_ptr_offset = free_ptr_offset;
   pinbox->free_func = free_func;
   pinbox->free_func_arg = free_func_arg;
 }
 
+void lf_pinbox_stop_reclaimer(LF_PINBOX *pinbox);
+
+/*
+  Destroy a pinbox.
+
+  NOTE
+    Nobody may use the pinbox anymore, so whatever is still waiting in
+    the handoff list cannot be pinned and is passed to free_func.
+*/
 void lf_pinbox_destroy(LF_PINBOX *pinbox) {
+  lf_pinbox_stop_reclaimer(pinbox);
+  void *first = pinbox->handoff.exchange(NULL);
+  if (first) {
+    void *last = first;
+    while (pnext_node(pinbox, last)) {
+      last = pnext_node(pinbox, last);
+    }
+    pinbox->free_func(first, last, pinbox->free_func_arg);
+  }
   lf_dynarray_destroy(&pinbox->pinarray);
+  lf_dynarray_destroy(&pinbox->pinmap);
 }
 
 /*
-  Get the next pointer in the purgatory list.
-  Note that next_node is not used to avoid the extra volatile.
+  Get the word of the live pins bitmap that holds the bit of LF_PINS
+  number 'nr'. Allocates memory if necessary.
 */
-#define pnext_node(P, X) (*((void **)(((char *)(X)) + (P)->free_ptr_offset)))
+static inline std::atomic<uint64> *lf_pinmap_word(LF_PINBOX *pinbox,
+                                                  uint32 nr) {
+  return static_cast<std::atomic<uint64> *>(
+      lf_dynarray_lvalue(&pinbox->pinmap, nr / LF_PINMAP_BITS));
+}
+
+static inline uint64 lf_pinmap_bit(uint32 nr) {
+  return 1ULL << (nr % LF_PINMAP_BITS);
+}
 
 struct st_match_and_save_arg {
   LF_PINS *pins;
@@ -356,69 +423,177 @@ static inline void add_to_purgatory(LF_PINS *pins, void *addr) {
 }
 
 /*
-  Callback for lf_dynarray_iterate:
-  Scan all pins of all threads, for each active (non-null) pin,
-  scan the current thread's purgatory. If present there, move it
-  to a new purgatory. At the end, the old purgatory will contain
-  pointers not pinned by any thread.
+  Callback for lf_pinbox_scan:
+  For each active (non-null) pin of one thread, scan the current thread's
+  purgatory. If present there, move it to a new purgatory. At the end of
+  the scan, the old purgatory will contain pointers not pinned by any thread.
+
+  RETURN
+    1 - the old purgatory is empty, the scan can be aborted
 */
-static int match_and_save(void *v_el, void *v_arg) {
-  LF_PINS *el = static_cast<LF_PINS *>(v_el);
-  st_match_and_save_arg *arg = static_cast<st_match_and_save_arg *>(v_arg);
+static int match_and_save(LF_PINS *el, st_match_and_save_arg *arg) {
   int i;
-  LF_PINS *el_end = el + LF_DYNARRAY_LEVEL_LENGTH;
-  for (; el < el_end; el++) {
-    for (i = 0; i < LF_PINBOX_PINS; i++) {
-      void *p = el->pin[i];
-      if (p) {
-        void *cur = arg->old_purgatory;
-        void **list_prev = &arg->old_purgatory;
-        // void *prev = cur;
-        while (cur) {
-          void *next = pnext_node(arg->pinbox, cur);
-
-          /* Problem: the old_purgatory list can not be connect */
-          if (p == cur) {
-            /* pinned - keeping */
-            add_to_purgatory(arg->pins, cur);
-            /* unlink from old purgatory */
-            /*
-              if(cur == arg->old_purgatory){
-                  *list_prev = next;
-              }else{
-                  pnext_node(pins->pinbox, prev) = next;
-              }
-            */
-            *list_prev = next;
-          } else {
-            
-            list_prev = (void **)((char *)cur + arg->pinbox->free_ptr_offset);
-          }
-          // prev = cur;
-          cur = next;
-        }
-        if (!arg->old_purgatory) {
-          return 1;
+  for (i = 0; i < LF_PINBOX_PINS; i++) {
+    void *p = el->pin[i];
+    if (p) {
+      void *cur = arg->old_purgatory;
+      void **list_prev = &arg->old_purgatory;
+      // void *prev = cur;
+      while (cur) {
+        void *next = pnext_node(arg->pinbox, cur);
+
+        /* Problem: the old_purgatory list can not be connect */
+        if (p == cur) {
+          /* pinned - keeping */
+          add_to_purgatory(arg->pins, cur);
+          /* unlink from old purgatory */
+          /*
+            if(cur == arg->old_purgatory){
+                *list_prev = next;
+            }else{
+                pnext_node(pins->pinbox, prev) = next;
+            }
+          */
+          *list_prev = next;
+        } else {
+          
+          list_prev = (void **)((char *)cur + arg->pinbox->free_ptr_offset);
         }
+        // prev = cur;
+        cur = next;
+      }
+      if (!arg->old_purgatory) {
+        return 1;
       }
     }
   }
   return 0;
 }
 
+/*
+  Call match_and_save() on every LF_PINS that is currently in use.
+
+  DESCRIPTION
+    The live pins bitmap is walked a word at a time, so released LF_PINS
+    cost one bit and a whole word of them is skipped at once. Only the
+    LF_PINS with a set bit are touched. A thread that takes an LF_PINS after
+    its bit was read here can only pin addresses that are already unlinked
+    (and thus unreachable) after re-validating them, so it cannot pin
+    anything from the purgatory being scanned.
+*/
+static void lf_pinbox_scan(LF_PINBOX *pinbox, st_match_and_save_arg *arg) {
+  uint64 nwords = pinbox->pins_in_array / LF_PINMAP_BITS + 1;
+  for (uint64 w = 0; w < nwords; w++) {
+    std::atomic<uint64> *word = static_cast<std::atomic<uint64> *>(
+        lf_dynarray_value(&pinbox->pinmap, w));
+    if (!word) {
+      continue; /* the owner of this word has not allocated it yet */
+    }
+    uint64 bits = word->load();
+    while (bits) {
+      uint32 nr = w * LF_PINMAP_BITS + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      LF_PINS *el =
+          static_cast<LF_PINS *>(lf_dynarray_value(&pinbox->pinarray, nr));
+      if (match_and_save(el, arg)) {
+        return;
+      }
+    }
+  }
+}
+
+/*
+  Wait until no thread has 'addr' pinned.
+
+  NOTE
+    'addr' must already be unreachable, and whoever pins it must check
+    after pinning that it's still reachable - as with any pin here.
+*/
+static void lf_pinbox_wait_unpinned(LF_PINBOX *pinbox, void *addr) {
+  uint64 nwords;
+retry:
+  nwords = pinbox->pins_in_array / LF_PINMAP_BITS + 1;
+  for (uint64 w = 0; w < nwords; w++) {
+    std::atomic<uint64> *word = static_cast<std::atomic<uint64> *>(
+        lf_dynarray_value(&pinbox->pinmap, w));
+    if (!word) {
+      continue;
+    }
+    uint64 bits = word->load();
+    while (bits) {
+      uint32 nr = w * LF_PINMAP_BITS + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      LF_PINS *el =
+          static_cast<LF_PINS *>(lf_dynarray_value(&pinbox->pinarray, nr));
+      for (int i = 0; i < LF_PINBOX_PINS; i++) {
+        if (el->pin[i] == addr) {
+          lf_thread_yield;
+          goto retry;
+        }
+      }
+    }
+  }
+}
+
+/*
+  Move every object of the list 'first' (linked through free_ptr_offset)
+  into the purgatory of 'pins'.
+*/
+static void lf_pinbox_adopt(LF_PINS *pins, void *first) {
+  while (first) {
+    void *next = pnext_node(pins->pinbox, first);
+    add_to_purgatory(pins, first);
+    first = next;
+  }
+}
+
+/*
+  Hand the whole purgatory of 'pins' over to the pinbox handoff list,
+  whoever scans it next frees it. The purgatory is empty on return.
+*/
+static void lf_pinbox_handoff(LF_PINS *pins) {
+  LF_PINBOX *pinbox = pins->pinbox;
+  void *first = pins->purgatory;
+  void *last = first;
+  void *top;
+
+  if (!first) {
+    return;
+  }
+  while (pnext_node(pinbox, last)) {
+    last = pnext_node(pinbox, last);
+  }
+  top = pinbox->handoff;
+  do {
+    pnext_node(pinbox, last) = top;
+  } while (!atomic_compare_exchange_strong(&pinbox->handoff, &top, first) &&
+           LF_BACKOFF);
+  pins->purgatory = NULL;
+  pins->purgatory_count = 0;
+}
+
 /*
   Scan the purgatory and free everything that can be freed
 */
 static void lf_pinbox_real_free(LF_PINS *pins) {
   LF_PINBOX *pinbox = pins->pinbox;
 
+  /*
+    Without a reclaimer nobody else looks at the handoff list, pick up
+    orphaned purgatories and what a stopped reclaimer has left behind.
+  */
+  if (unlikely(pinbox->handoff.load(std::memory_order_relaxed) != NULL) &&
+      pinbox->reclaimer_state == LF_RECLAIMER_NONE) {
+    lf_pinbox_adopt(pins, pinbox->handoff.exchange(NULL));
+  }
+
   /* Store info about current purgatory. */
   struct st_match_and_save_arg arg = {pins, pinbox, pins->purgatory};
   /* Reset purgatory. */
   pins->purgatory = NULL;
   pins->purgatory_count = 0;
 
-  lf_dynarray_iterate(&pinbox->pinarray, match_and_save, &arg);
+  lf_pinbox_scan(pinbox, &arg);
 
   if (arg.old_purgatory) {
     /* Some objects in the old purgatory were not pinned, free them. */
@@ -441,7 +616,7 @@ static void lf_pinbox_real_free(LF_PINS *pins) {
     or allocate a new one out of dynarray.
 */
 LF_PINS *lf_pinbox_get_pins(LF_PINBOX *pinbox) {
-  uint32 pins, next, top_ver;
+  uint64 pins, next, top_ver;
   LF_PINS *el;
   
   top_ver = pinbox->pinstack_top_ver;
@@ -457,7 +632,7 @@ LF_PINS *lf_pinbox_get_pins(LF_PINBOX *pinbox) {
         index 0 is reserved to mean "NULL pointer"
       */
       el = (LF_PINS *)lf_dynarray_lvalue(&pinbox->pinarray, pins);
-      if (unlikely(!el)) {
+      if (unlikely(!el || !lf_pinmap_word(pinbox, pins))) {
         return 0;
       }
       break;
@@ -474,7 +649,10 @@ LF_PINS *lf_pinbox_get_pins(LF_PINBOX *pinbox) {
   */
   el->link = pins;
   el->purgatory_count = 0;
+  el->snapshot = 0;
   el->pinbox = pinbox;
+  /* make el visible to lf_pinbox_scan() before it can pin anything */
+  lf_pinmap_word(pinbox, pins)->fetch_or(lf_pinmap_bit(pins));
   return el;
 }
 
@@ -482,26 +660,29 @@ LF_PINS *lf_pinbox_get_pins(LF_PINBOX *pinbox) {
   Put pins back to a pinbox.
 
   DESCRIPTION
-    empty the purgatory (XXX deadlock warning below!),
+    try once to empty the purgatory, orphan what is left of it,
     push LF_PINS structure to a stack
 */
 void lf_pinbox_put_pins(LF_PINS *pins) {
   LF_PINBOX *pinbox = pins->pinbox;
-  uint32 top_ver, nr;
+  uint64 top_ver;
+  uint32 nr;
   nr = pins->link;
 
   /*
-    XXX this will deadlock if other threads will wait for
-    the caller to do something after _lf_pinbox_put_pins(),
-    and they would have pinned addresses that the caller wants to free.
-    Thus: only free pins when all work is done and nobody can wait for you!!!
+    Waiting here until other threads unpin what the caller has freed
+    would deadlock if they wait for the caller to do something after
+    lf_pinbox_put_pins(). Instead, objects that are still pinned are
+    orphaned to the handoff list, the reclaimer or the next
+    lf_pinbox_real_free() of any thread frees them later.
   */
-  while (pins->purgatory_count) {
+  if (pins->purgatory_count &&
+      pinbox->reclaimer_state != LF_RECLAIMER_RUNNING) {
     lf_pinbox_real_free(pins);
-    if (pins->purgatory_count) {
-      lf_thread_yield;
-    }
   }
+  lf_pinbox_handoff(pins);
+  /* from now on lf_pinbox_scan() skips this LF_PINS */
+  lf_pinmap_word(pinbox, nr)->fetch_and(~lf_pinmap_bit(nr));
   top_ver = pinbox->pinstack_top_ver;
   do {
     pins->link = top_ver % LF_PINBOX_MAX_PINS;
@@ -515,13 +696,102 @@ void lf_pinbox_put_pins(LF_PINS *pins) {
 
   DESCRIPTION
     add an object to purgatory. if necessary, call lf_pinbox_real_free()
-    to actually free something.
+    to actually free something, or hand the full purgatory off to the
+    background reclaimer when there is one.
 */
+static void lf_pinbox_flush(LF_PINS *pins) {
+  if (pins->pinbox->reclaimer_state == LF_RECLAIMER_RUNNING) {
+    lf_pinbox_handoff(pins);
+  } else {
+    lf_pinbox_real_free(pins);
+  }
+}
+
 void lf_pinbox_free(LF_PINS *pins, void *addr) {
   add_to_purgatory(pins, addr);
   if (pins->purgatory_count % LF_PURGATORY_SIZE == 0) {
-    lf_pinbox_real_free(pins);
+    lf_pinbox_flush(pins);
+  }
+}
+
+/*
+  Body of the background reclaimer thread.
+
+  DESCRIPTION
+    Adopt the purgatory batches handed off by lf_pinbox_free(), scan the
+    pins and free what nobody has pinned. Objects that are still pinned
+    stay in the reclaimer purgatory for the next round. On stop whatever
+    is still pinned goes back to the handoff list, so stopping never
+    waits for other threads.
+*/
+static void *lf_pinbox_reclaimer(void *arg) {
+  LF_PINBOX *pinbox = static_cast<LF_PINBOX *>(arg);
+  LF_PINS *pins = lf_pinbox_get_pins(pinbox);
+  DBUG_ASSERT(pins);
+
+  for (;;) {
+    bool stopping = pinbox->reclaimer_state != LF_RECLAIMER_RUNNING;
+    void *batch = pinbox->handoff.exchange(NULL);
+
+    lf_pinbox_adopt(pins, batch);
+    if (pins->purgatory_count) {
+      lf_pinbox_real_free(pins);
+    }
+    if (stopping) {
+      break;
+    }
+    if (!batch) {
+      usleep(LF_RECLAIMER_SLEEP_US);
+    }
+  }
+
+  /* orphans what is still pinned */
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+/*
+  Start a background reclaimer thread for a pinbox.
+
+  DESCRIPTION
+    From now on lf_pinbox_free() does not scan the pins itself, it hands
+    every LF_PURGATORY_SIZE objects off to the reclaimer. This takes the
+    scan off the latency of the deleting threads.
+
+  RETURN
+    0 - ok
+   -1 - the reclaimer is already running or the thread can't be created
+*/
+int lf_pinbox_start_reclaimer(LF_PINBOX *pinbox) {
+  int expected = LF_RECLAIMER_NONE;
+  if (!pinbox->reclaimer_state.compare_exchange_strong(expected,
+                                                       LF_RECLAIMER_RUNNING)) {
+    return -1;
+  }
+  if (pthread_create(&pinbox->reclaimer, NULL, lf_pinbox_reclaimer, pinbox)) {
+    pinbox->reclaimer_state = LF_RECLAIMER_NONE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Stop the background reclaimer thread, if any, and wait for it.
+
+  NOTE
+    Like destroy, not thread safe: no thread may free objects through
+    the pinbox while it is being stopped. Objects that are still pinned
+    remain in the handoff list, the next lf_pinbox_real_free() or
+    lf_pinbox_destroy() takes care of them.
+*/
+void lf_pinbox_stop_reclaimer(LF_PINBOX *pinbox) {
+  int expected = LF_RECLAIMER_RUNNING;
+  if (!pinbox->reclaimer_state.compare_exchange_strong(expected,
+                                                       LF_RECLAIMER_STOPPING)) {
+    return;
   }
+  pthread_join(pinbox->reclaimer, NULL);
+  pinbox->reclaimer_state = LF_RECLAIMER_NONE;
 }
 
 static inline void lf_pin(LF_PINS *pins, int pin, void *addr) {
@@ -555,6 +825,10 @@ struct LF_ALLOCATOR {
   LF_PINBOX pinbox;
   std::atomic<uchar *> top;
   uint element_size;
+  uint alignment; /* of every object, 0 means what lf_alloc() gives */
+  bool fixed;     /* never malloc, the preallocated objects are all */
+  uchar *slab;    /* preallocated objects, see lf_alloc_prealloc() */
+  size_t slab_size;
   std::atomic<uint32> mallocs;
   lf_allocator_func *constructor; /* called, when an object is malloc()'ed */
   lf_allocator_func *destructor;  /* called, when an object is free()'d    */
@@ -601,11 +875,108 @@ void lf_alloc_init2(LF_ALLOCATOR *allocator, uint size, uint free_ptr_offset,
   allocator->top = 0;
   allocator->mallocs = 0;
   allocator->element_size = size;
+  allocator->alignment = 0;
+  allocator->fixed = false;
+  allocator->slab = NULL;
+  allocator->slab_size = 0;
   allocator->constructor = ctor;
   allocator->destructor = dtor;
   DBUG_ASSERT(size >= sizeof(void *) + free_ptr_offset);
 }
 
+/*
+  Allocate memory aligned to 'alignment', or just lf_alloc() it if
+  'alignment' is 0. Either way it is freed with lf_free().
+*/
+static inline void *lf_alloc_aligned(size_t size, uint alignment) {
+  void *ptr;
+  if (!alignment) {
+    return lf_alloc(size);
+  }
+  if (posix_memalign(&ptr, alignment, size)) {
+    return NULL;
+  }
+  return ptr;
+}
+
+/*
+  Align every object of the allocator to 'alignment' bytes.
+
+  DESCRIPTION
+    The object size is rounded up to a multiple of 'alignment' as well,
+    so with LF_CACHE_LINE_SIZE an object starts a cache line and never
+    shares a line with its neighbour: its header is never split over two
+    lines, and two threads writing neighbouring objects don't false share.
+    Must be called before anything is allocated.
+*/
+void lf_alloc_set_alignment(LF_ALLOCATOR *allocator, uint alignment) {
+  DBUG_ASSERT(!allocator->mallocs);
+  DBUG_ASSERT(alignment % sizeof(void *) == 0);
+  DBUG_ASSERT(!(alignment & (alignment - 1)));
+  allocator->alignment = alignment;
+  if (alignment) {
+    allocator->element_size =
+        (allocator->element_size + alignment - 1) & ~(alignment - 1);
+  }
+}
+
+static inline bool lf_alloc_in_slab(LF_ALLOCATOR *allocator, void *addr) {
+  return (uchar *)addr >= allocator->slab &&
+         (uchar *)addr < allocator->slab + allocator->slab_size;
+}
+
+/*
+  free an object that nobody can see anymore, bypassing the pinbox.
+  Preallocated objects are freed with the slab in lf_alloc_destroy().
+*/
+static inline void lf_alloc_direct_free(LF_ALLOCATOR *allocator, void *addr) {
+  if (allocator->destructor) {
+    allocator->destructor((uchar *)addr);
+  }
+  if (!lf_alloc_in_slab(allocator, addr)) {
+    lf_free(addr);
+  }
+}
+
+/*
+  Preallocate 'n' objects in one slab and put them in the allocator
+  stack.
+
+  DESCRIPTION
+    With 'fixed' the allocator never calls malloc afterwards:
+    lf_alloc_new() returns NULL when the preallocated objects are all
+    in use. Must be called before anything is allocated.
+
+  RETURN
+    0 - ok
+   -1 - out of memory
+*/
+int lf_alloc_prealloc(LF_ALLOCATOR *allocator, uint n, bool fixed) {
+  DBUG_ASSERT(!allocator->mallocs && !allocator->slab);
+  size_t size = (size_t)allocator->element_size * n;
+  allocator->fixed = fixed;
+  if (!n) {
+    return 0;
+  }
+  allocator->slab = static_cast<uchar *>(lf_alloc_aligned(
+      size, lf_max(allocator->alignment, (uint)sizeof(void *))));
+  if (unlikely(!allocator->slab)) {
+    return -1;
+  }
+  allocator->slab_size = size;
+  /* push them in reverse, so they are handed out in address order */
+  for (uint i = n; i--;) {
+    uchar *node = allocator->slab + (size_t)allocator->element_size * i;
+    if (allocator->constructor) {
+      allocator->constructor(node);
+    }
+    anext_node(node) = allocator->top.load();
+    allocator->top = node;
+  }
+  allocator->mallocs = n;
+  return 0;
+}
+
 /*
   destroy the allocator, free everything that's in it
 
@@ -618,16 +989,16 @@ void lf_alloc_init2(LF_ALLOCATOR *allocator, uint size, uint free_ptr_offset,
     Oh yes, and don't put your cat in a microwave.
 */
 void lf_alloc_destroy(LF_ALLOCATOR *allocator) {
+  /* returns the objects of the handoff list to the allocator stack */
+  lf_pinbox_destroy(&allocator->pinbox);
   uchar *node = allocator->top;
   while (node) {
     uchar *tmp = anext_node(node);
-    if (allocator->destructor) {
-      allocator->destructor(node);
-    }
-    lf_free(node);
+    lf_alloc_direct_free(allocator, node);
     node = tmp;
   }
-  lf_pinbox_destroy(&allocator->pinbox);
+  lf_free(allocator->slab);
+  allocator->slab = NULL;
   allocator->top = 0;
 }
 
@@ -637,9 +1008,10 @@ void lf_alloc_destroy(LF_ALLOCATOR *allocator) {
   DESCRIPTION
     Pop an unused object from the stack or malloc it is the stack is empty.
     pin[0] is used, it's removed on return.
+    'pins' may belong to the pinbox of another allocator, as long as
+    objects of 'allocator' are freed through that pinbox too.
 */
-void *lf_alloc_new(LF_PINS *pins) {
-  LF_ALLOCATOR *allocator = (LF_ALLOCATOR *)(pins->pinbox->free_func_arg);
+static void *lf_alloc_new_from(LF_ALLOCATOR *allocator, LF_PINS *pins) {
   uchar *node;
   for (;;) {
     do {
@@ -647,8 +1019,11 @@ void *lf_alloc_new(LF_PINS *pins) {
       lf_pin(pins, 0, node);
     } while (node != allocator->top && LF_BACKOFF);
     if (!node) {
+      if (allocator->fixed) {
+        break; /* all preallocated objects are in use */
+      }
       node = static_cast<uchar *>(
-          lf_alloc(allocator->element_size));
+          lf_alloc_aligned(allocator->element_size, allocator->alignment));
       if (likely(node != 0)) {
         if (allocator->constructor) {
           allocator->constructor(node);
@@ -666,6 +1041,15 @@ void *lf_alloc_new(LF_PINS *pins) {
   return node;
 }
 
+/*
+  only for pins of an allocator's own pinbox whose free_func is still
+  alloc_free(), e.g. not an LF_HASH that replaced it
+*/
+void *lf_alloc_new(LF_PINS *pins) {
+  return lf_alloc_new_from((LF_ALLOCATOR *)(pins->pinbox->free_func_arg),
+                           pins);
+}
+
 /*
   count the number of objects in a pool.
 
@@ -680,19 +1064,58 @@ uint lf_alloc_pool_count(LF_ALLOCATOR *allocator) {
   return i;
 }
 
-static inline void lf_alloc_direct_free(LF_ALLOCATOR *allocator, void *addr) {
-  if (allocator->destructor) {
-    allocator->destructor((uchar *)addr);
-  }
-  lf_free(addr);
-}
 
 /*
   lock-free lists
 */
 #define LF_HASH_UNIQUE 1
+#define LF_HASH_INTRUSIVE 2 /* elements embed their LF_SLIST, see below */
+#define LF_HASH_ALIGN_NODES 4 /* nodes start a cache line, none shares one */
+#define LF_HASH_INLINE_KEYS 8 /* keys are copied into the node, see below */
+#define LF_HASH_EAGER_BUCKETS 16 /* inserts initialize new buckets ahead */
+#define LF_HASH_BLOOM 32 /* a bloom filter answers most misses, see below */
+#define LF_HASH_MVCC 64 /* versioned elements for snapshot scans, see below */
+
+/*
+  With LF_HASH_EAGER_BUCKETS every insert initializes up to this many of
+  the buckets that the last doubling created. A doubling happens after
+  'size' inserts, so the new buckets are all initialized long before the
+  next one, and most of them before foreground traffic reaches them.
+*/
+#define LF_HASH_EAGER_STEP 4
+
+/*
+  LF_HASH_INLINE_KEYS nodes come in size classes, class c holds keys of
+  up to (LF_HASH_KEY_CLASS_MIN << c) bytes.
+*/
+#define LF_HASH_KEY_CLASSES 8
+#define LF_HASH_KEY_CLASS_MIN 16
+#define LF_HASH_MAX_INLINE_KEY \
+  (LF_HASH_KEY_CLASS_MIN << (LF_HASH_KEY_CLASSES - 1))
 typedef bool hash_equal_func(void *, void *, size_t);
 typedef bool hash_walk_action(void *);
+struct LF_SLIST;
+/* returns true if it has marked the node deleted */
+typedef bool lf_node_walk_func(LF_SLIST *node, const uchar *key,
+                               size_t keylen, void *arg);
+
+/*
+  What my_lfind() does with every normal node when it walks the whole
+  list: call 'action' with the element, or 'node_action' with the node.
+*/
+struct LF_WALK {
+  hash_walk_action *action;
+  intptr element_offset; /* of the element from the node */
+  lf_node_walk_func *node_action;
+  void *arg;
+};
+
+/*
+  LF_HASH_MVCC marks a deleted element by setting this bit in its keylen,
+  it does not match any key after that but stays in the list for the
+  snapshots that can still see it.
+*/
+#define LF_KEYLEN_DEAD ((size_t)1 << (sizeof(size_t) * 8 - 1))
 
 /* An element of the list */
 struct LF_SLIST {
@@ -700,7 +1123,8 @@ struct LF_SLIST {
       link;      /* a pointer to the next element in a list and a flag */
   uint32 hashnr; /* reversed hash number, for sorting                 */
   const uchar *key;
-  size_t keylen;
+  /* atomic: LF_HASH_MVCC sets LF_KEYLEN_DEAD while readers compare it */
+  std::atomic<size_t> keylen;
   /*
     data is stored here, directly after the keylen.
     thus the pointer to data is (void*)(slist_element_ptr+1)
@@ -758,7 +1182,7 @@ static inline T *SET_DELETED(T *ptr) {
 */
 static int my_lfind(std::atomic<LF_SLIST *> *head,
                     uint32 hashnr, const uchar *key, size_t keylen,
-                    CURSOR *cursor, LF_PINS *pins, hash_equal_func *equal_func, hash_walk_action *walk_action) {
+                    CURSOR *cursor, LF_PINS *pins, hash_equal_func *equal_func, LF_WALK *walk) {
   uint32 cur_hashnr;
   const uchar *cur_key;
   size_t cur_keylen;
@@ -790,22 +1214,42 @@ retry:
     }
     if (!DELETED(link)) {
 
-      if(walk_action && (cur_hashnr & 1)){ 
-        // iterate all normal elements
-        walk_action(cursor->curr + 1);
-      }else if(hashnr & 1 && cur_hashnr & 1 && hashnr == cur_hashnr){ 
-        // find a dummy node         
-        return 1;
-      } else if (!(hashnr & 1 || cur_hashnr & 1) && (*equal_func)((void*)cur_key, (void*)key, cur_keylen)){  
-          // find a normal node                      
-          return 1;
+      if (walk) {
+        // iterate all normal elements, dummy nodes are skipped
+        if ((cur_hashnr & 1) && walk->node_action) {
+          if (walk->node_action(cursor->curr, cur_key, cur_keylen,
+                                walk->arg)) {
+            /*
+              marked deleted by the action, unlink it below. A marked
+              link never changes, and nobody can unlink its target
+              while it's there, so that's safe to pin.
+            */
+            link = cursor->curr->link.load();
+            cursor->next = PTR(link);
+            lf_pin(pins, 0, cursor->next);
+            goto unlink;
+          }
+        } else if ((cur_hashnr & 1) && !(cur_keylen & LF_KEYLEN_DEAD)) {
+          walk->action((uchar *)cursor->curr + walk->element_offset);
+        }
       } else if (cur_hashnr > hashnr) {
         // out of the bucket
         return 0;
+      } else if (cur_hashnr == hashnr) {
+        if (!(hashnr & 1)) {
+          // find a dummy node, there is one per bucket
+          return 1;
+        }
+        if (cur_keylen == keylen &&
+            (*equal_func)((void *)cur_key, (void *)key, keylen)) {
+          // find a normal node, same hashnr is not enough (collisions)
+          return 1;
+        }
       }
       cursor->prev = &(cursor->curr->link);
       lf_pin(pins, 2, cursor->curr);
     } else {
+    unlink:
       /*
         we found a deleted node - be nice, help the other thread
         and remove this deleted node
@@ -908,10 +1352,13 @@ static LF_SLIST *linsert(std::atomic<LF_SLIST *> *head,
 
   NOTE
     it uses pins[0..2], on return all pins are removed.
+    with 'defer_free' the node is put in the purgatory without a scan,
+    the caller calls lf_pinbox_flush() when it's done.
 */
 static int ldelete(std::atomic<LF_SLIST *> *head,
                    uint32 hashnr, const uchar *key, uint keylen,
-                   LF_PINS *pins, hash_equal_func *callback) {
+                   LF_PINS *pins, hash_equal_func *callback,
+                   bool defer_free = false) {
   CURSOR cursor;
   int res;
 
@@ -926,7 +1373,11 @@ static int ldelete(std::atomic<LF_SLIST *> *head,
         /* and remove it from the list */
         if (atomic_compare_exchange_strong(cursor.prev, &cursor.curr,
                                            cursor.next)) {
-          lf_pinbox_free(pins, cursor.curr);
+          if (defer_free) {
+            add_to_purgatory(pins, cursor.curr);
+          } else {
+            lf_pinbox_free(pins, cursor.curr);
+          }
         } else {
           /*
             somebody already "helped" us and removed the node ?
@@ -952,10 +1403,26 @@ static int ldelete(std::atomic<LF_SLIST *> *head,
 */
 #define MAX_LOAD 1 /* average number of elements in a bucket */
 
+/*
+  A blocked bloom filter: a key sets and tests LF_BLOOM_K bits that all
+  lie in one cache line sized block, so a test costs one cache miss.
+  Bits are set with an atomic OR and never cleared.
+*/
+#define LF_BLOOM_BLOCK_WORDS (LF_CACHE_LINE_SIZE / sizeof(uint64))
+#define LF_BLOOM_BLOCK_BITS (LF_CACHE_LINE_SIZE * 8)
+#define LF_BLOOM_K 6
+#define LF_BLOOM_BITS_PER_KEY 16
+
+struct LF_BLOOM {
+  uint64 block_mask; /* number of blocks - 1 */
+  std::atomic<uint64> *blocks;
+};
+
 struct LF_HASH;
 typedef const uchar *(*hash_get_key_function)(const uchar *arg, size_t *length);
 typedef ulint lf_hash_func(const uchar *, size_t);
 typedef void lf_hash_init_func(uchar *dst, uchar *src);
+typedef void lf_hash_reclaim_func(void *element, void *arg);
 static const uchar *dummy_key = (uchar *)"";
 
 
@@ -969,7 +1436,9 @@ struct LF_HASH {
   uint element_size;             /* size of memcpy'ed area on insert */
   uint flags;                    /* LF_HASH_UNIQUE, etc */
   std::atomic<int32> size;       /* size of array */
+  int32 max_size;                /* size never doubles past it */
   std::atomic<int32> count;      /* number of elements in the hash */
+  std::atomic<int32> init_cursor; /* buckets below are eagerly initialized */
   int max_load;                  /* average number of elements in a bucket */
   /**
     "Initialize" hook - called to finish initialization of object provided by
@@ -982,8 +1451,99 @@ struct LF_HASH {
      lf_hash_insert.
   */
   lf_hash_init_func *initialize;
+  /*
+    LF_HASH_INTRUSIVE only: offset of the LF_SLIST hook in the caller's
+    element, and the callback that hands an element back to its owner
+    once it is deleted and no thread has it pinned anymore.
+  */
+  uint hook_offset;
+  lf_hash_reclaim_func *reclaim;
+  void *reclaim_arg;
+  /*
+    LF_HASH_INLINE_KEYS only: an allocator per key size class. They
+    share the pinbox of 'alloc', so one LF_PINS protects all nodes.
+  */
+  LF_ALLOCATOR *key_classes;
+  /*
+    LF_HASH_BLOOM only: the filter that searches test, and the one being
+    filled by lf_hash_bloom_rebuild(), if any. Both are pinned by pin[3].
+  */
+  std::atomic<LF_BLOOM *> bloom;
+  std::atomic<LF_BLOOM *> bloom_next;
+  /* searches answered by the filter, and that it let through in vain */
+  std::atomic<uint64> bloom_negatives;
+  std::atomic<uint64> bloom_false_positives;
+  /*
+    fixed capacity only: preallocated bucket dummy nodes, and the
+    pinbox free_func that lf_hash_free_nodes() passes all other nodes on to
+  */
+  LF_ALLOCATOR *dummies;
+  lf_pinbox_free_func *node_free_func;
+  void *node_free_arg;
+  /*
+    LF_HASH_MVCC only: the last version stamp handed out, the number of
+    snapshot scans in progress, a hint of how many deleted elements are
+    kept for them, and whether one thread is purging those already.
+  */
+  std::atomic<uint64> version;
+  std::atomic<int32> snapshots;
+  std::atomic<int32> dead;
+  std::atomic<bool> purging;
 };
 
+/*
+  LF_HASH_MVCC: every node carries the versions that inserted and deleted
+  it, stored between the node and the element. An element is in the
+  snapshot at version S if insert_ver <= S < delete_ver. 0 means "not yet"
+  for both, and LF_VERSION_PENDING that a delete is taking its stamp.
+  Whoever finds a linked or claimed node unstamped stamps it, see
+  lf_hash_stamp().
+*/
+struct LF_VERSIONS {
+  std::atomic<uint64> insert_ver;
+  std::atomic<uint64> delete_ver;
+};
+#define LF_VERSION_PENDING (~(uint64)0)
+
+static inline LF_VERSIONS *lf_hash_versions(LF_SLIST *node) {
+  return reinterpret_cast<LF_VERSIONS *>(node + 1);
+}
+
+/*
+  Give 'ver' a new version if it's still 'unstamped' and return the
+  stamp, the first stamp wins. A snapshot scan stamps the nodes whose
+  writer hasn't yet instead of waiting for it: the stamp is then newer
+  than the snapshot, as if the insert or delete came after the scan
+  started.
+*/
+static inline uint64 lf_hash_stamp(LF_HASH *hash, std::atomic<uint64> *ver,
+                                   uint64 unstamped) {
+  uint64 stamp = ver->load();
+  if (stamp != unstamped) {
+    return stamp;
+  }
+  uint64 mine = hash->version.fetch_add(1) + 1;
+  return ver->compare_exchange_strong(stamp, mine) ? mine : stamp;
+}
+
+/*
+  Get the element of a normal node: it's stored right after the node,
+  or the node is a hook inside the element in LF_HASH_INTRUSIVE mode.
+*/
+static inline intptr lf_hash_element_offset(const LF_HASH *hash) {
+  if (hash->flags & LF_HASH_INTRUSIVE) {
+    return -(intptr)hash->hook_offset;
+  }
+  if (hash->flags & LF_HASH_MVCC) {
+    return sizeof(LF_SLIST) + sizeof(LF_VERSIONS);
+  }
+  return sizeof(LF_SLIST);
+}
+
+static inline void *lf_hash_element(const LF_HASH *hash, LF_SLIST *node) {
+  return (uchar *)node + lf_hash_element_offset(hash);
+}
+
 static inline const uchar *hash_key(const LF_HASH *hash, const uchar *record,
                                     size_t *length) {
   if (hash->get_key) {
@@ -1004,10 +1564,76 @@ static inline uint calc_hash(LF_HASH *hash, const uchar *key, size_t keylen) {
 }
 
 
-/*
-  Initializes lf_hash, the arguments are compatible with hash_init
+static inline uint lf_hash_key_class(size_t keylen) {
+  uint key_class = 0;
+  while ((size_t)(LF_HASH_KEY_CLASS_MIN << key_class) < keylen) {
+    key_class++;
+  }
+  return key_class;
+}
 
-  @note element_size sets both the size of allocated memory block for
+/*
+  pinbox free_func of an LF_HASH_INLINE_KEYS hash: return every node of
+  first->...->last to the allocator of its key class. keylen is intact
+  in the purgatory, only 'key' is used for the list link.
+*/
+static void lf_hash_free_key_nodes(void *v_first, void *v_last,
+                                   void *v_hash) {
+  LF_HASH *hash = static_cast<LF_HASH *>(v_hash);
+  LF_SLIST *node = static_cast<LF_SLIST *>(v_first);
+  for (;;) {
+    LF_SLIST *next = (LF_SLIST *)pnext_node(&hash->alloc.pinbox, node);
+    alloc_free(node, node, &hash->key_classes[lf_hash_key_class(node->keylen)]);
+    if (node == v_last) {
+      break;
+    }
+    node = next;
+  }
+}
+
+/*
+  Set up LF_HASH_INLINE_KEYS.
+
+  DESCRIPTION
+    With get_key returning pointers into memory the element only refers
+    to, e.g. a string key, lf_hash_insert() would copy the pointer, not
+    the key, and the caller would need a separate allocation per key
+    that the pinbox knows nothing about. Instead, the key bytes are
+    copied right after the element and the node is taken from the
+    allocator of its key size class; the key lives and dies with the
+    node and is reclaimed by the pinbox like the rest of it.
+*/
+static void lf_hash_init_key_classes(LF_HASH *hash, lf_allocator_func *ctor,
+                                     lf_allocator_func *dtor) {
+  hash->key_classes = static_cast<LF_ALLOCATOR *>(
+      lf_alloc(sizeof(LF_ALLOCATOR) * LF_HASH_KEY_CLASSES));
+  DBUG_ASSERT(hash->key_classes);
+  for (uint i = 0; i < LF_HASH_KEY_CLASSES; i++) {
+    lf_alloc_init2(&hash->key_classes[i],
+                   sizeof(LF_SLIST) + hash->element_size +
+                       (LF_HASH_KEY_CLASS_MIN << i),
+                   offsetof(LF_SLIST, key), ctor, dtor);
+    lf_alloc_set_alignment(&hash->key_classes[i], hash->alloc.alignment);
+  }
+  hash->alloc.pinbox.free_func = lf_hash_free_key_nodes;
+  hash->alloc.pinbox.free_func_arg = hash;
+}
+
+/*
+  The key copy of an element of an LF_HASH_INLINE_KEYS hash, valid as
+  long as the element is (i.e. while it's pinned).
+*/
+const uchar *lf_hash_element_key(LF_HASH *hash, const void *element,
+                                 size_t *keylen) {
+  DBUG_ASSERT(hash->key_classes);
+  *keylen = ((const LF_SLIST *)element - 1)->keylen;
+  return (const uchar *)element + hash->element_size;
+}
+
+/*
+  Initializes lf_hash, the arguments are compatible with hash_init
+
+  @note element_size sets both the size of allocated memory block for
   lf_alloc and a size of memcpy'ed block size in lf_hash_insert. Typically
   they are the same, indeed. But LF_HASH::element_size can be decreased
   after lf_hash_init, and then lf_alloc will allocate larger block that
@@ -1026,11 +1652,14 @@ void lf_hash_init2(LF_HASH *hash, uint element_size, uint flags,
                    hash_get_key_function get_key, lf_hash_func *hash_function, 
                    hash_equal_func *equal_func, lf_allocator_func *ctor, 
                    lf_allocator_func *dtor, lf_hash_init_func *init) {
-  lf_alloc_init2(&hash->alloc, sizeof(LF_SLIST) + element_size,
+  uint versions = (flags & LF_HASH_MVCC) ? sizeof(LF_VERSIONS) : 0;
+  lf_alloc_init2(&hash->alloc, sizeof(LF_SLIST) + versions + element_size,
                  offsetof(LF_SLIST, key), ctor, dtor);
   lf_dynarray_init(&hash->array, sizeof(LF_SLIST *));
   hash->size = 1;
+  hash->max_size = INT_MAX32 / 2 + 1;
   hash->count = 0;
+  hash->init_cursor = 1;
   hash->max_load = MAX_LOAD;
   hash->element_size = element_size;
   hash->flags = flags;
@@ -1040,7 +1669,316 @@ void lf_hash_init2(LF_HASH *hash, uint element_size, uint flags,
   hash->hash_function = hash_function;
   hash->equal_func = equal_func;
   hash->initialize = init;
+  if (flags & LF_HASH_ALIGN_NODES) {
+    lf_alloc_set_alignment(&hash->alloc, LF_CACHE_LINE_SIZE);
+  }
+  hash->hook_offset = 0;
+  hash->reclaim = NULL;
+  hash->reclaim_arg = NULL;
+  hash->key_classes = NULL;
+  hash->bloom = NULL;
+  hash->bloom_next = NULL;
+  hash->bloom_negatives = 0;
+  hash->bloom_false_positives = 0;
+  hash->dummies = NULL;
+  hash->node_free_func = NULL;
+  hash->node_free_arg = NULL;
+  hash->version = 1;
+  hash->snapshots = 0;
+  hash->dead = 0;
+  hash->purging = false;
+  DBUG_ASSERT(!(flags & LF_HASH_BLOOM)); /* see lf_hash_bloom_init() */
+  /* versions live in nodes that the hash allocates with a fixed layout */
+  DBUG_ASSERT(!(flags & LF_HASH_MVCC) ||
+              !(flags & (LF_HASH_INTRUSIVE | LF_HASH_INLINE_KEYS)));
   DBUG_ASSERT(get_key ? !key_offset && !key_length : key_length);
+  if (flags & LF_HASH_INLINE_KEYS) {
+    lf_hash_init_key_classes(hash, ctor, dtor);
+  }
+}
+
+/*
+  pinbox free_func of an LF_HASH_INTRUSIVE hash: give the unpinned
+  elements first->...->last back to their owner.
+*/
+static void lf_hash_reclaim_elements(void *v_first, void *v_last,
+                                     void *v_hash) {
+  LF_HASH *hash = static_cast<LF_HASH *>(v_hash);
+  LF_SLIST *node = static_cast<LF_SLIST *>(v_first);
+  for (;;) {
+    LF_SLIST *next = (LF_SLIST *)pnext_node(&hash->alloc.pinbox, node);
+    hash->reclaim(lf_hash_element(hash, node), hash->reclaim_arg);
+    if (node == v_last) {
+      break;
+    }
+    node = next;
+  }
+}
+
+/*
+  Initializes an intrusive lf_hash.
+
+  DESCRIPTION
+    The elements are not copied into nodes allocated by the hash, the
+    caller embeds an LF_SLIST at 'hook_offset' of its own objects and
+    lf_hash_insert() links the object itself. The hash never allocates
+    or frees elements: once a deleted element can't be reached by any
+    thread anymore, reclaim(element, reclaim_arg) is called and the
+    owner may free or reuse it. lf_hash_destroy() reclaims the elements
+    that are still in the hash.
+
+    The key of an element must not change while it is in the hash, the
+    hook must not be touched by the owner until it is reclaimed.
+*/
+void lf_hash_init_intrusive(LF_HASH *hash, uint hook_offset, uint flags,
+                            uint key_offset, uint key_length,
+                            hash_get_key_function get_key,
+                            lf_hash_func *hash_function,
+                            hash_equal_func *equal_func,
+                            lf_hash_reclaim_func *reclaim,
+                            void *reclaim_arg) {
+  DBUG_ASSERT(hook_offset % sizeof(void *) == 0);
+  DBUG_ASSERT(reclaim);
+  DBUG_ASSERT(!(flags & LF_HASH_INLINE_KEYS));
+  lf_hash_init2(hash, 0, flags | LF_HASH_INTRUSIVE, key_offset, key_length,
+                get_key, hash_function, equal_func, NULL, NULL, NULL);
+  hash->hook_offset = hook_offset;
+  hash->reclaim = reclaim;
+  hash->reclaim_arg = reclaim_arg;
+  /* the pinbox hands unpinned hooks to the owner, not to the allocator */
+  hash->alloc.pinbox.free_func = lf_hash_reclaim_elements;
+  hash->alloc.pinbox.free_func_arg = hash;
+}
+
+/*
+  bloom filter
+*/
+static LF_BLOOM *lf_bloom_new(uint64 nkeys) {
+  uint64 nblocks = 1;
+  while (nblocks * LF_BLOOM_BLOCK_BITS < nkeys * LF_BLOOM_BITS_PER_KEY) {
+    nblocks <<= 1;
+  }
+  LF_BLOOM *bloom = static_cast<LF_BLOOM *>(lf_alloc(sizeof(LF_BLOOM)));
+  if (unlikely(!bloom)) {
+    return NULL;
+  }
+  bloom->block_mask = nblocks - 1;
+  bloom->blocks = static_cast<std::atomic<uint64> *>(lf_alloc_aligned(
+      nblocks * LF_CACHE_LINE_SIZE, LF_CACHE_LINE_SIZE));
+  if (unlikely(!bloom->blocks)) {
+    lf_free(bloom);
+    return NULL;
+  }
+  memset((void *)bloom->blocks, 0, nblocks * LF_CACHE_LINE_SIZE);
+  return bloom;
+}
+
+static void lf_bloom_free(LF_BLOOM *bloom) {
+  if (bloom) {
+    lf_free(bloom->blocks);
+    lf_free(bloom);
+  }
+}
+
+/* murmur3 finalizer, spreads the 31 bits of a hash value over 64 */
+static inline uint64 lf_bloom_mix(uint64 h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+  The block of 'hashnr' is chosen by one mix of it, the LF_BLOOM_K bits
+  in the block by 9 bit slices of another.
+*/
+static inline std::atomic<uint64> *lf_bloom_block(LF_BLOOM *bloom,
+                                                  uint hashnr, uint64 *bits) {
+  uint64 h = lf_bloom_mix(hashnr);
+  *bits = lf_bloom_mix(h ^ hashnr);
+  return bloom->blocks + (h & bloom->block_mask) * LF_BLOOM_BLOCK_WORDS;
+}
+
+static void lf_bloom_add(LF_BLOOM *bloom, uint hashnr) {
+  uint64 bits;
+  std::atomic<uint64> *block = lf_bloom_block(bloom, hashnr, &bits);
+  for (int i = 0; i < LF_BLOOM_K; i++, bits >>= 9) {
+    uint bit = bits % LF_BLOOM_BLOCK_BITS;
+    std::atomic<uint64> &word = block[bit / 64];
+    uint64 mask = 1ULL << (bit % 64);
+    if (!(word.load(std::memory_order_relaxed) & mask)) {
+      word.fetch_or(mask);
+    }
+  }
+}
+
+static bool lf_bloom_test(LF_BLOOM *bloom, uint hashnr) {
+  uint64 bits;
+  std::atomic<uint64> *block = lf_bloom_block(bloom, hashnr, &bits);
+  for (int i = 0; i < LF_BLOOM_K; i++, bits >>= 9) {
+    uint bit = bits % LF_BLOOM_BLOCK_BITS;
+    if (!(block[bit / 64].load() & (1ULL << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+  Pin *filter with pin[3]. Returns the filter, NULL if there is none.
+*/
+static inline LF_BLOOM *lf_bloom_pin(std::atomic<LF_BLOOM *> *filter,
+                                     LF_PINS *pins) {
+  LF_BLOOM *bloom;
+  do {
+    bloom = *filter;
+    lf_pin(pins, 3, bloom);
+  } while (bloom != *filter && LF_BACKOFF);
+  return bloom;
+}
+
+/*
+  must come after lf_alloc_destroy(&hash->alloc), that returns the
+  leftovers of the pinbox to the key classes
+*/
+static void lf_hash_destroy_key_classes(LF_HASH *hash) {
+  if (!hash->key_classes) {
+    return;
+  }
+  for (uint i = 0; i < LF_HASH_KEY_CLASSES; i++) {
+    lf_alloc_destroy(&hash->key_classes[i]);
+  }
+  lf_free(hash->key_classes);
+  hash->key_classes = NULL;
+}
+
+static int lf_mlock_leaf(void *ptr, void *arg) {
+  return mlock(ptr, LF_DYNARRAY_LEVEL_LENGTH * *(uint *)arg);
+}
+
+static bool lf_hash_is_dummy(LF_HASH *hash, const uchar *node) {
+  const uchar *slab = hash->dummies->slab;
+  return node >= slab && node < slab + hash->dummies->slab_size;
+}
+
+/*
+  pinbox free_func of a fixed capacity hash: the dummies that lost a race
+  in initialize_bucket() go back to hash->dummies, the other nodes of
+  first->...->last are relinked and passed on to the free_func that the
+  pinbox had before.
+*/
+static void lf_hash_free_nodes(void *v_first, void *v_last, void *v_hash) {
+  LF_HASH *hash = static_cast<LF_HASH *>(v_hash);
+  LF_PINBOX *pinbox = &hash->alloc.pinbox;
+  uchar *node = static_cast<uchar *>(v_first);
+  uchar *first = NULL, *last = NULL;
+  for (;;) {
+    uchar *next = (uchar *)pnext_node(pinbox, node);
+    bool at_end = node == v_last;
+    if (lf_hash_is_dummy(hash, node)) {
+      alloc_free(node, node, hash->dummies);
+    } else {
+      if (last) {
+        pnext_node(pinbox, last) = node;
+      } else {
+        first = node;
+      }
+      last = node;
+    }
+    if (at_end) {
+      break;
+    }
+    node = next;
+  }
+  if (first) {
+    hash->node_free_func(first, last, hash->node_free_arg);
+  }
+}
+
+/*
+  Make the hash fixed-capacity, with no malloc on insert, delete or
+  search.
+
+  DESCRIPTION
+    All memory these need is allocated here: 'max_elements' nodes and
+    one dummy node per bucket in two slabs, and the bucket array for
+    'max_buckets' buckets (rounded down to a power of two, the hash
+    does not double past it). An insert that would need one more node
+    fails with -1 at once. With 'lock_memory' the slabs and the bucket
+    array are mlock()'ed, so that there are no page faults either.
+
+    Must be called right after lf_hash_init2(), before the hash is
+    used. Not for LF_HASH_INLINE_KEYS; with LF_HASH_INTRUSIVE the hash
+    has no nodes of its own and 'max_elements' is ignored.
+    LF_PINS are still allocated by lf_pinbox_get_pins(), get them before
+    latency matters.
+
+  RETURN
+    0 - ok
+    1 - ok, but mlock() failed (see RLIMIT_MEMLOCK), memory is not locked
+   -1 - out of memory
+*/
+int lf_hash_set_fixed_capacity(LF_HASH *hash, uint max_elements,
+                               uint max_buckets, bool lock_memory) {
+  DBUG_ASSERT(!hash->count && !hash->key_classes && !hash->dummies);
+  int res = 0;
+  int32 size = 1;
+  while (size <= INT_MAX32 / 2 && (uint)size * 2 <= max_buckets) {
+    size *= 2;
+  }
+  hash->max_size = size;
+
+  if (!(hash->flags & LF_HASH_INTRUSIVE) &&
+      lf_alloc_prealloc(&hash->alloc, max_elements, true)) {
+    return -1;
+  }
+
+  hash->dummies = static_cast<LF_ALLOCATOR *>(lf_alloc(sizeof(LF_ALLOCATOR)));
+  if (unlikely(!hash->dummies)) {
+    return -1;
+  }
+  lf_alloc_init2(hash->dummies, sizeof(LF_SLIST), offsetof(LF_SLIST, key),
+                 NULL, NULL);
+  lf_alloc_set_alignment(hash->dummies, hash->alloc.alignment);
+  /*
+    a dummy that loses a race sits in a purgatory until the next scan,
+    see lf_hash_free_dummy(), the slack covers those
+  */
+  if (lf_alloc_prealloc(hash->dummies, size + size / 8 + LF_PURGATORY_SIZE,
+                        true)) {
+    return -1;
+  }
+  hash->node_free_func = hash->alloc.pinbox.free_func;
+  hash->node_free_arg = hash->alloc.pinbox.free_func_arg;
+  hash->alloc.pinbox.free_func = lf_hash_free_nodes;
+  hash->alloc.pinbox.free_func_arg = hash;
+
+  for (int32 bucket = 0; bucket < size; bucket++) {
+    if (unlikely(!lf_dynarray_lvalue(&hash->array, bucket))) {
+      return -1;
+    }
+  }
+
+  if (lock_memory) {
+    uint size_of_element = hash->array.size_of_element;
+    if ((hash->alloc.slab &&
+         mlock(hash->alloc.slab, hash->alloc.slab_size)) ||
+        mlock(hash->dummies->slab, hash->dummies->slab_size) ||
+        lf_dynarray_iterate(&hash->array, lf_mlock_leaf, &size_of_element)) {
+      res = 1;
+    }
+  }
+  return res;
+}
+
+static void lf_hash_destroy_dummies(LF_HASH *hash) {
+  if (hash->dummies) {
+    lf_alloc_destroy(hash->dummies);
+    lf_free(hash->dummies);
+    hash->dummies = NULL;
+  }
 }
 
 void lf_hash_destroy(LF_HASH *hash) {
@@ -1048,6 +1986,10 @@ void lf_hash_destroy(LF_HASH *hash) {
 
   if (unlikely(!head)) {
     lf_alloc_destroy(&hash->alloc);
+    lf_hash_destroy_key_classes(hash);
+    lf_hash_destroy_dummies(hash);
+    lf_dynarray_destroy(&hash->array);
+    lf_bloom_free(hash->bloom.exchange(NULL));
     return;
   }
   el = *head;
@@ -1055,14 +1997,56 @@ void lf_hash_destroy(LF_HASH *hash) {
   while (el) {
     LF_SLIST *next = el->link;
     if (el->hashnr & 1) {
-      lf_alloc_direct_free(&hash->alloc, el); /* normal node */
-    } else {
-      lf_free(el); /* dummy node */
+      if (hash->flags & LF_HASH_INTRUSIVE) {
+        hash->reclaim(lf_hash_element(hash, el), hash->reclaim_arg);
+      } else {
+        lf_alloc_direct_free(&hash->alloc, el); /* normal node */
+      }
+    } else if (!hash->dummies) {
+      lf_free(el); /* dummy node, preallocated ones go with the slab */
     }
     el = (LF_SLIST *)next;
   }
   lf_alloc_destroy(&hash->alloc);
+  lf_hash_destroy_key_classes(hash);
+  lf_hash_destroy_dummies(hash);
   lf_dynarray_destroy(&hash->array);
+  lf_bloom_free(hash->bloom.exchange(NULL));
+}
+
+/*
+  Allocate a dummy node. Bucket heads are the hottest nodes, with
+  LF_HASH_ALIGN_NODES they're kept apart as well.
+*/
+static LF_SLIST *lf_hash_new_dummy(LF_HASH *hash, LF_PINS *pins) {
+  if (hash->dummies) {
+    LF_SLIST *dummy = (LF_SLIST *)lf_alloc_new_from(hash->dummies, pins);
+    if (unlikely(!dummy)) {
+      /* our own lost dummies may be waiting in the purgatory */
+      lf_pinbox_flush(pins);
+      dummy = (LF_SLIST *)lf_alloc_new_from(hash->dummies, pins);
+    }
+    return dummy;
+  }
+  return (LF_SLIST *)lf_alloc_aligned(
+      lf_max(sizeof(LF_SLIST), (size_t)hash->alloc.alignment),
+      hash->alloc.alignment);
+}
+
+/*
+  free a dummy node that was never linked. A preallocated one must go
+  through the pinbox like any other node: another thread may still have
+  it pinned by pin[0] of lf_alloc_new_from(), with a stale next, and
+  pushing it right back would let that thread's CAS succeed and hand out
+  a dummy that is in use.
+*/
+static void lf_hash_free_dummy(LF_HASH *hash, LF_SLIST *dummy,
+                               LF_PINS *pins) {
+  if (hash->dummies) {
+    lf_pinbox_free(pins, dummy);
+  } else {
+    lf_free(dummy);
+  }
 }
 
 /*
@@ -1073,8 +2057,7 @@ void lf_hash_destroy(LF_HASH *hash) {
 static int initialize_bucket(LF_HASH *hash, std::atomic<LF_SLIST *> *node,
                              uint bucket, LF_PINS *pins) {
   uint parent = clear_highest_bit(bucket);
-  LF_SLIST *dummy =
-      (LF_SLIST *)lf_alloc(sizeof(LF_SLIST));
+  LF_SLIST *dummy = lf_hash_new_dummy(hash, pins);
   if (unlikely(!dummy)) {
     return -1;
   }
@@ -1083,19 +2066,19 @@ static int initialize_bucket(LF_HASH *hash, std::atomic<LF_SLIST *> *node,
   std::atomic<LF_SLIST *> *el = static_cast<std::atomic<LF_SLIST *> *>(
       lf_dynarray_lvalue(&hash->array, parent));
   if (unlikely(!el)) {
-    lf_free(dummy);
+    lf_hash_free_dummy(hash, dummy, pins);
     return -1;
   }
   if (el->load() == nullptr && bucket &&
       unlikely(initialize_bucket(hash, el, parent, pins))) {
-    lf_free(dummy);
+    lf_hash_free_dummy(hash, dummy, pins);
     return -1;
   }
   dummy->hashnr = reverse_bits(bucket) | 0; /* dummy node */
   dummy->key = dummy_key;
   dummy->keylen = 0;
   if ((cur = linsert(el, dummy, pins, LF_HASH_UNIQUE, hash->equal_func))) {
-    lf_free(dummy);
+    lf_hash_free_dummy(hash, dummy, pins);
     dummy = cur;
   }
   atomic_compare_exchange_strong(node, &tmp, dummy);
@@ -1110,76 +2093,491 @@ static int initialize_bucket(LF_HASH *hash, std::atomic<LF_SLIST *> *node,
   return 0;
 }
 
+/*
+  Add hashnr of an inserted element to the filters. Called after the
+  node is linked, see lf_hash_bloom_rebuild() on why. bloom_next must
+  be read before bloom: a rebuild replaces bloom before it clears
+  bloom_next, so whichever of the two is read the new filter gets the key.
+*/
+static void lf_hash_bloom_add(LF_HASH *hash, LF_PINS *pins, uint hashnr) {
+  LF_BLOOM *bloom = lf_bloom_pin(&hash->bloom_next, pins);
+  if (bloom) {
+    lf_bloom_add(bloom, hashnr);
+  }
+  bloom = lf_bloom_pin(&hash->bloom, pins);
+  if (bloom) {
+    lf_bloom_add(bloom, hashnr);
+  }
+  lf_unpin(pins, 3);
+}
+
+/*
+  Set up LF_HASH_BLOOM.
+
+  DESCRIPTION
+    Searches for keys that are not in the hash test a bloom filter
+    first and most of them return without walking the bucket. Inserts
+    add their key to it. A delete can't clear bits, so the filter fills
+    up with stale keys and a table that grows overfills it; the false
+    positive rate is reported by lf_hash_bloom_fp_rate(), and
+    lf_hash_bloom_rebuild() replaces the filter with a fresh one sized
+    for the current count.
+
+    Must be called before the hash is used.
+
+  RETURN
+    0 - ok
+   -1 - out of memory
+*/
+int lf_hash_bloom_init(LF_HASH *hash, uint64 expected_keys) {
+  DBUG_ASSERT(!hash->count && !hash->bloom);
+  hash->bloom = lf_bloom_new(lf_max(expected_keys, (uint64)1));
+  if (unlikely(!hash->bloom.load())) {
+    return -1;
+  }
+  hash->flags |= LF_HASH_BLOOM;
+  return 0;
+}
+
+static bool lf_bloom_add_key(LF_SLIST *, const uchar *key, size_t keylen,
+                             void *arg) {
+  LF_HASH *hash = static_cast<LF_HASH *>(arg);
+  if (!(keylen & LF_KEYLEN_DEAD)) {
+    lf_bloom_add(hash->bloom_next, calc_hash(hash, key, keylen));
+  }
+  return false;
+}
+
+/*
+  Rebuild the bloom filter, concurrently with inserts and searches.
+
+  DESCRIPTION
+    A new filter sized for the current count is published as bloom_next,
+    then every element in the list is added to it, then it replaces the
+    current filter. An insert adds its key to bloom_next, then to bloom,
+    after it has linked its node. If it reads bloom_next as NULL, either
+    the rebuild had not published it yet, so the node was linked before
+    the walk started and the walk adds it, or the rebuild has already
+    cleared it, so bloom is the new filter by the time the insert reads
+    it. A key that reaches only the old filter is never lost.
+    The old filter is freed once no thread has it pinned anymore.
+
+  RETURN
+    0 - ok
+    1 - another rebuild is in progress
+   -1 - out of memory
+*/
+int lf_hash_bloom_rebuild(LF_HASH *hash, LF_PINS *pins) {
+  DBUG_ASSERT(hash->flags & LF_HASH_BLOOM);
+  LF_BLOOM *expected = NULL;
+  LF_BLOOM *bloom = lf_bloom_new(lf_max((uint64)hash->count, (uint64)1));
+  if (unlikely(!bloom)) {
+    return -1;
+  }
+  if (!hash->bloom_next.compare_exchange_strong(expected, bloom)) {
+    lf_bloom_free(bloom);
+    return 1;
+  }
+
+  std::atomic<LF_SLIST *> *el = static_cast<std::atomic<LF_SLIST *> *>(
+      lf_dynarray_lvalue(&hash->array, 0));
+  if (unlikely(!el) || (el->load() == nullptr &&
+                        unlikely(initialize_bucket(hash, el, 0, pins)))) {
+    hash->bloom_next = NULL;
+    lf_pinbox_wait_unpinned(&hash->alloc.pinbox, bloom);
+    lf_bloom_free(bloom);
+    return -1;
+  }
+  CURSOR cursor;
+  LF_WALK walk = {NULL, 0, lf_bloom_add_key, hash};
+  my_lfind(el, 0, 0, 0, &cursor, pins, hash->equal_func, &walk);
+  lf_unpin(pins, 2);
+  lf_unpin(pins, 1);
+  lf_unpin(pins, 0);
+
+  LF_BLOOM *old = hash->bloom.exchange(bloom);
+  hash->bloom_next = NULL;
+  hash->bloom_negatives = 0;
+  hash->bloom_false_positives = 0;
+  lf_pinbox_wait_unpinned(&hash->alloc.pinbox, old);
+  lf_bloom_free(old);
+  return 0;
+}
+
+/*
+  The share of searches for missing keys that the bloom filter let
+  through, since it was last (re)built.
+*/
+double lf_hash_bloom_fp_rate(LF_HASH *hash) {
+  uint64 fp = hash->bloom_false_positives.load(std::memory_order_relaxed);
+  uint64 tn = hash->bloom_negatives.load(std::memory_order_relaxed);
+  return fp + tn ? (double)fp / (fp + tn) : 0;
+}
+
+/*
+  DESCRIPTION
+    initializes up to 'n' buckets that are not initialized yet since the
+    hash has last doubled, so that foreground inserts, deletes and
+    searches find them ready instead of paying for a recursive
+    initialize_bucket() with a malloc and a CAS. Buckets are claimed in
+    order through hash->init_cursor, concurrent callers never do the
+    same bucket twice.
+
+    Called from lf_hash_insert() with LF_HASH_EAGER_BUCKETS, it can also
+    be called from a background thread with its own pins.
+
+  RETURN
+    number of buckets claimed, 0 if all buckets are initialized
+   -1 - out of memory
+
+  NOTE
+    see linsert() for pin usage notes
+*/
+int lf_hash_initialize_buckets(LF_HASH *hash, LF_PINS *pins, int n) {
+  int done;
+  for (done = 0; done < n; done++) {
+    int32 bucket = hash->init_cursor;
+    do {
+      if (bucket >= hash->size) {
+        return done;
+      }
+    } while (!atomic_compare_exchange_weak(&hash->init_cursor, &bucket,
+                                           bucket + 1));
+    std::atomic<LF_SLIST *> *el = static_cast<std::atomic<LF_SLIST *> *>(
+        lf_dynarray_lvalue(&hash->array, bucket));
+    if (unlikely(!el)) {
+      return -1;
+    }
+    if (el->load() == nullptr &&
+        unlikely(initialize_bucket(hash, el, bucket, pins))) {
+      return -1;
+    }
+  }
+  return done;
+}
+
+/*
+  DESCRIPTION
+    finds the list head to start a read-only search in 'bucket' from.
+    If the bucket is not initialized yet, its elements are still linked
+    after the dummy node of its parent bucket (the list is sorted by
+    reversed hash and clear_highest_bit() gives the parent), so we walk
+    up the parent chain to the nearest initialized bucket instead of
+    calling initialize_bucket().
+
+  RETURN
+    0    - even bucket 0 is not initialized (the hash is empty)
+    head - the head of the nearest initialized bucket
+
+  NOTE
+    never allocates memory and does no CAS, it only reads the bucket array.
+*/
+static std::atomic<LF_SLIST *> *find_initialized_bucket(LF_HASH *hash,
+                                                        uint bucket) {
+  for (;;) {
+    std::atomic<LF_SLIST *> *el = static_cast<std::atomic<LF_SLIST *> *>(
+        lf_dynarray_value(&hash->array, bucket));
+    if (el && el->load() != nullptr) {
+      return el;
+    }
+    if (!bucket) {
+      return 0;
+    }
+    bucket = clear_highest_bit(bucket);
+  }
+}
+
 /*
   DESCRIPTION
     inserts a new element to a hash. it will have a _copy_ of
     data, not a pointer to it.
+    In LF_HASH_INTRUSIVE mode 'data' itself is linked through its hook
+    and nothing is copied or allocated except for bucket dummy nodes.
 
   RETURN
     0 - inserted
     1 - didn't (unique key conflict)
-   -1 - out of memory
+   -1 - out of memory (or, with LF_HASH_INLINE_KEYS, the key is longer
+        than LF_HASH_MAX_INLINE_KEY)
 
   NOTE
     see linsert() for pin usage notes
+    In LF_HASH_INTRUSIVE mode the caller still owns 'data' if it was not
+    inserted, it's never passed to the reclaim callback.
 */
 int lf_hash_insert(LF_HASH *hash, LF_PINS *pins, void *data) {
   int csize, bucket, hashnr;
   LF_SLIST *node;
   std::atomic<LF_SLIST *> *el;
-
-  node = (LF_SLIST *)lf_alloc_new(pins);
-  if (unlikely(!node)) {
-    return -1;
-  }
-  uchar *extra_data =
-      (uchar *)(node + 1);  // Stored immediately after the node.
-  if (hash->initialize) {
-    (*hash->initialize)(extra_data, (uchar*)data);
+  bool intrusive = hash->flags & LF_HASH_INTRUSIVE;
+
+  if (intrusive) {
+    size_t keylen;
+    node = (LF_SLIST *)((uchar *)data + hash->hook_offset);
+    node->key = hash_key(hash, (uchar *)data, &keylen);
+    node->keylen = keylen;
+  } else if (hash->key_classes) {
+    size_t keylen;
+    const uchar *key = hash_key(hash, (uchar *)data, &keylen);
+    if (unlikely(keylen > LF_HASH_MAX_INLINE_KEY)) {
+      return -1;
+    }
+    node = (LF_SLIST *)lf_alloc_new_from(
+        &hash->key_classes[lf_hash_key_class(keylen)], pins);
+    if (unlikely(!node)) {
+      return -1;
+    }
+    uchar *extra_data = (uchar *)(node + 1);
+    if (hash->initialize) {
+      (*hash->initialize)(extra_data, (uchar*)data);
+    } else {
+      memcpy(extra_data, data, hash->element_size);
+    }
+    /* the key copy follows the element, see lf_hash_element_key() */
+    memcpy(extra_data + hash->element_size, key, keylen);
+    node->key = extra_data + hash->element_size;
+    node->keylen = keylen;
   } else {
-    memcpy(extra_data, data, hash->element_size);
+    node = (LF_SLIST *)lf_alloc_new_from(&hash->alloc, pins);
+    if (unlikely(!node)) {
+      return -1;
+    }
+    uchar *extra_data = (uchar *)lf_hash_element(
+        hash, node);  // Stored immediately after the node.
+    if (hash->initialize) {
+      (*hash->initialize)(extra_data, (uchar*)data);
+    } else {
+      memcpy(extra_data, data, hash->element_size);
+    }
+    size_t keylen;
+    node->key = hash_key(hash, extra_data, &keylen);
+    node->keylen = keylen;
+    if (hash->flags & LF_HASH_MVCC) {
+      lf_hash_versions(node)->insert_ver = 0;
+      lf_hash_versions(node)->delete_ver = 0;
+    }
   }
-  node->key = hash_key(hash, (uchar *)(node + 1), &node->keylen);
   hashnr = calc_hash(hash, node->key, node->keylen);
   bucket = hashnr % hash->size;
   el = static_cast<std::atomic<LF_SLIST *> *>(
       lf_dynarray_lvalue(&hash->array, bucket));
   if (unlikely(!el)) {
-    lf_pinbox_free(pins, node);
+    if (!intrusive) {
+      lf_pinbox_free(pins, node);
+    }
     return -1;
   }
   if (el->load() == nullptr &&
       unlikely(initialize_bucket(hash, el, bucket, pins))) {
-    lf_pinbox_free(pins, node);
+    if (!intrusive) {
+      lf_pinbox_free(pins, node);
+    }
     return -1;
   }
   
   node->hashnr = reverse_bits(hashnr) | 1; /* normal node */
   if (linsert(el, node, pins, hash->flags, hash->equal_func)) {
-    lf_pinbox_free(pins, node);
+    /* never linked, in intrusive mode nobody can have seen the hook */
+    if (!intrusive) {
+      lf_pinbox_free(pins, node);
+    }
     return 1;
   }
+  if (hash->flags & LF_HASH_MVCC) {
+    /* a snapshot scan that gets here first stamps it for us */
+    lf_hash_stamp(hash, &lf_hash_versions(node)->insert_ver, 0);
+  }
+  if (hash->flags & LF_HASH_BLOOM) {
+    lf_hash_bloom_add(hash, pins, hashnr);
+  }
   csize = hash->size;
-  if ((hash->count.fetch_add(1) + 1.0) / csize > hash->max_load) {
+  if ((hash->count.fetch_add(1) + 1.0) / csize > hash->max_load &&
+      csize < hash->max_size) {
     atomic_compare_exchange_strong(&hash->size, &csize, csize * 2);
   }
+  if (hash->flags & LF_HASH_EAGER_BUCKETS) {
+    lf_hash_initialize_buckets(hash, pins, LF_HASH_EAGER_STEP);
+  }
   return 0;
 }
 
 /*
-  DESCRIPTION
-    deletes an element with the given key from the hash (if a hash is
-    not unique and there're many elements with this key - the "first"
-    matching element is deleted)
-  RETURN
-    0 - deleted
-    1 - didn't (not found)
-   -1 - out of memory
-  NOTE
-    see ldelete() for pin usage notes
+  LF_HASH_MVCC: mark a node deleted in the list sense, so that it can be
+  unlinked. Returns false if somebody else has marked it already.
 */
-int lf_hash_delete(LF_HASH *hash, LF_PINS *pins, const void *key, uint keylen) {
-  std::atomic<LF_SLIST *> *el;
+static bool lf_hash_mark_unlinked(LF_SLIST *node) {
+  LF_SLIST *next = node->link.load();
+  do {
+    if (DELETED(next)) {
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak(&node->link, &next,
+                                         SET_DELETED(next)));
+  return true;
+}
+
+/*
+  LF_HASH_MVCC: the oldest snapshot that is being scanned, or 'version'
+  if none is. Snapshot scans that start later can't be older than that.
+*/
+static uint64 lf_hash_oldest_snapshot(LF_HASH *hash) {
+  LF_PINBOX *pinbox = &hash->alloc.pinbox;
+  uint64 oldest = hash->version.load();
+  uint64 nwords = pinbox->pins_in_array / LF_PINMAP_BITS + 1;
+  for (uint64 w = 0; w < nwords; w++) {
+    std::atomic<uint64> *word = static_cast<std::atomic<uint64> *>(
+        lf_dynarray_value(&pinbox->pinmap, w));
+    if (!word) {
+      continue;
+    }
+    uint64 bits = word->load();
+    while (bits) {
+      uint32 nr = w * LF_PINMAP_BITS + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      LF_PINS *el =
+          static_cast<LF_PINS *>(lf_dynarray_value(&pinbox->pinarray, nr));
+      uint64 snapshot = el->snapshot.load();
+      if (snapshot && snapshot < oldest) {
+        oldest = snapshot;
+      }
+    }
+  }
+  return oldest;
+}
+
+struct lf_purge_arg {
+  LF_HASH *hash;
+  uint64 oldest;
+  int32 kept;
+};
+
+static bool lf_hash_purge_node(LF_SLIST *node, const uchar *,
+                               size_t keylen, void *arg) {
+  lf_purge_arg *purge = static_cast<lf_purge_arg *>(arg);
+  if (!(keylen & LF_KEYLEN_DEAD)) {
+    return false;
+  }
+  uint64 delete_ver = lf_hash_versions(node)->delete_ver.load();
+  if (delete_ver > purge->oldest) {
+    purge->kept++; /* a snapshot can still see it */
+    return false;
+  }
+  return lf_hash_mark_unlinked(node);
+}
+
+/*
+  DESCRIPTION
+    LF_HASH_MVCC: unlink the deleted elements that no snapshot scan can
+    see anymore, they are freed through the pinbox as usual. Called by
+    lf_hash_snapshot_iterate() when it's done, one thread purges at a time.
+
+  RETURN
+    0 - ok (or another thread is purging)
+    1 - the hash is empty
+*/
+int lf_hash_purge_versions(LF_HASH *hash, LF_PINS *pins) {
+  CURSOR cursor;
+  std::atomic<LF_SLIST *> *el;
+
+  if (hash->purging.exchange(true)) {
+    return 0;
+  }
+  el = find_initialized_bucket(hash, 0);
+  if (unlikely(!el)) {
+    hash->purging = false;
+    return 1;
+  }
+  /* deletes that come after this are counted again */
+  hash->dead.exchange(0);
+  lf_purge_arg purge = {hash, lf_hash_oldest_snapshot(hash), 0};
+  LF_WALK walk = {NULL, 0, lf_hash_purge_node, &purge};
+  my_lfind(el, 0, 0, 0, &cursor, pins, hash->equal_func, &walk);
+  lf_unpin(pins, 2);
+  lf_unpin(pins, 1);
+  lf_unpin(pins, 0);
+  hash->dead += purge.kept;
+  hash->purging = false;
+  return 0;
+}
+
+/*
+  DESCRIPTION
+    LF_HASH_MVCC delete: the first live node with the key gets a delete
+    stamp and a dead keylen, which no search or insert matches anymore.
+    If no snapshot scan is running it's unlinked right away, otherwise
+    it stays in the list for the scans that still see it and is unlinked
+    by lf_hash_purge_versions() later.
+
+  RETURN
+    0 - deleted
+    1 - not found
+
+  NOTE
+    see ldelete() for pin usage notes
+*/
+static int lf_hash_mvcc_delete(LF_HASH *hash, std::atomic<LF_SLIST *> *head,
+                               uint32 hashnr, const uchar *key, uint keylen,
+                               LF_PINS *pins) {
+  LF_SLIST *node;
+  CURSOR cursor;
+
+  for (;;) {
+    node = my_lsearch(head, hashnr, key, keylen, pins, hash->equal_func);
+    if (!node) {
+      return 1;
+    }
+    /* the claim decides between concurrent deletes of the same node */
+    uint64 live = 0;
+    if (lf_hash_versions(node)->delete_ver.compare_exchange_strong(
+            live, LF_VERSION_PENDING)) {
+      break;
+    }
+    (void)LF_BACKOFF; /* it's dead as soon as the winner has its stamp */
+  }
+  /*
+    Stamp before the keylen dies: a unique insert of the same key can
+    only succeed after that, so its insert_ver is newer than our stamp
+    and no snapshot ever sees both. The node may not have its insert
+    stamp yet either, it must come first.
+  */
+  lf_hash_stamp(hash, &lf_hash_versions(node)->insert_ver, 0);
+  lf_hash_stamp(hash, &lf_hash_versions(node)->delete_ver,
+                LF_VERSION_PENDING);
+  node->keylen.fetch_or(LF_KEYLEN_DEAD);
+
+  if (hash->snapshots.load() == 0) {
+    /*
+      A scan that starts now takes a snapshot newer than our stamp, it
+      won't miss the node. my_lfind() unlinks it on the way past it.
+    */
+    if (lf_hash_mark_unlinked(node)) {
+      my_lfind(head, hashnr, NULL, (size_t)-1, &cursor, pins,
+               hash->equal_func, 0);
+      lf_unpin(pins, 0);
+      lf_unpin(pins, 1);
+    }
+  } else if (hash->dead.fetch_add(1) == 0 && hash->snapshots.load() == 0) {
+    /* the last scan has just ended and may have missed it */
+    lf_hash_purge_versions(hash, pins);
+  }
+  lf_unpin(pins, 2);
+  return 0;
+}
+
+/*
+  DESCRIPTION
+    deletes an element with the given key from the hash (if a hash is
+    not unique and there're many elements with this key - the "first"
+    matching element is deleted)
+  RETURN
+    0 - deleted
+    1 - didn't (not found)
+   -1 - out of memory
+  NOTE
+    see ldelete() for pin usage notes
+*/
+int lf_hash_delete(LF_HASH *hash, LF_PINS *pins, const void *key, uint keylen) {
+  std::atomic<LF_SLIST *> *el;
   uint bucket, hashnr = calc_hash(hash, (uchar *)key, keylen);
 
   bucket = hashnr % hash->size;
@@ -1198,14 +2596,70 @@ int lf_hash_delete(LF_HASH *hash, LF_PINS *pins, const void *key, uint keylen) {
       unlikely(initialize_bucket(hash, el, bucket, pins))) {
     return -1;
   }
-  if (ldelete(el, reverse_bits(hashnr) | 1, (uchar *)key,
-              keylen, pins, hash->equal_func)) {
+  if (hash->flags & LF_HASH_MVCC
+          ? lf_hash_mvcc_delete(hash, el, reverse_bits(hashnr) | 1,
+                                (uchar *)key, keylen, pins)
+          : ldelete(el, reverse_bits(hashnr) | 1, (uchar *)key, keylen,
+                    pins, hash->equal_func)) {
     return 1;
   }
   --hash->count;
   return 0;
 }
 
+/*
+  DESCRIPTION
+    deletes the elements with the keys keys[0..n-1] (of the lengths
+    keylens[0..n-1]) from the hash, in the given order.
+
+    Each key is deleted as by lf_hash_delete(), but the unlinked nodes go
+    to the purgatory without a scan: instead of one lf_pinbox_real_free()
+    (or handoff to the reclaimer) per LF_PURGATORY_SIZE deletes, there is
+    at most one for the whole batch, at the end. A scan walks the whole
+    purgatory for every pin in use, so keep batches to a few purgatories.
+    LF_HASH_MVCC deletes are freed as usual.
+
+  RETURN
+    number of elements deleted (keys that were not found are skipped)
+   -1 - out of memory
+
+  NOTE
+    see ldelete() for pin usage notes
+*/
+int lf_hash_delete_batch(LF_HASH *hash, LF_PINS *pins, const void *const *keys,
+                         const uint *keylens, uint n) {
+  int deleted = 0, res = 0;
+
+  for (uint i = 0; i < n; i++) {
+    std::atomic<LF_SLIST *> *el;
+    uint bucket, hashnr = calc_hash(hash, (const uchar *)keys[i], keylens[i]);
+
+    bucket = hashnr % hash->size;
+    el = static_cast<std::atomic<LF_SLIST *> *>(
+        lf_dynarray_lvalue(&hash->array, bucket));
+    /* see lf_hash_delete() on why the bucket must be initialized */
+    if (unlikely(!el) ||
+        (el->load() == nullptr &&
+         unlikely(initialize_bucket(hash, el, bucket, pins)))) {
+      res = -1;
+      break;
+    }
+    if (hash->flags & LF_HASH_MVCC
+            ? !lf_hash_mvcc_delete(hash, el, reverse_bits(hashnr) | 1,
+                                   (const uchar *)keys[i], keylens[i], pins)
+            : !ldelete(el, reverse_bits(hashnr) | 1, (const uchar *)keys[i],
+                       keylens[i], pins, hash->equal_func, true)) {
+      deleted++;
+    }
+  }
+
+  hash->count -= deleted;
+  if (pins->purgatory_count >= LF_PURGATORY_SIZE) {
+    lf_pinbox_flush(pins);
+  }
+  return res ? res : deleted;
+}
+
 /**
   Find hash element corresponding to the key.
 
@@ -1220,6 +2674,9 @@ int lf_hash_delete(LF_HASH *hash, LF_PINS *pins, const void *key, uint keylen) {
           element).
   @retval NULL         - if nothing is found
 
+  @note Read-only: never allocates memory and never initializes buckets,
+        an uninitialized bucket is searched from its nearest initialized
+        ancestor, see find_initialized_bucket().
   @note Uses pins[0..2]. On return pins[0..1] are removed and pins[2]
         is used to pin object found. It is also not removed in case when
         object is not found/error occurs but pin value is undefined in
@@ -1237,18 +2694,27 @@ void *lf_hash_search(LF_HASH *hash, LF_PINS *pins, const void *key,
 
   bucket = hashnr % hash->size;
 
-  el = static_cast<std::atomic<LF_SLIST *> *>(
-      lf_dynarray_lvalue(&hash->array, bucket));
-  if (unlikely(!el)) {
-    return 0;
+  if (hash->flags & LF_HASH_BLOOM) {
+    LF_BLOOM *bloom = lf_bloom_pin(&hash->bloom, pins);
+    bool maybe = lf_bloom_test(bloom, hashnr);
+    lf_unpin(pins, 3);
+    if (!maybe) {
+      hash->bloom_negatives.fetch_add(1, std::memory_order_relaxed);
+      lf_unpin(pins, 2);
+      return 0;
+    }
   }
-  if (el->load() == nullptr &&
-      unlikely(initialize_bucket(hash, el, bucket, pins))) {
-    return 0;
+
+  el = find_initialized_bucket(hash, bucket);
+  if (unlikely(!el)) {
+    return 0; /* bucket 0 is not initialized, the hash is empty */
   }
 
   found = my_lsearch(el, reverse_bits(hashnr) | 1, (uchar *)key, keylen, pins, hash->equal_func);
-  return found ? found + 1 : 0;
+  if (!found && (hash->flags & LF_HASH_BLOOM)) {
+    hash->bloom_false_positives.fetch_add(1, std::memory_order_relaxed);
+  }
+  return found ? lf_hash_element(hash, found) : 0;
 }
 
 /**
@@ -1257,6 +2723,7 @@ void *lf_hash_search(LF_HASH *hash, LF_PINS *pins, const void *key,
   @note
   If one of 'action' invocations returns 1 the iteration aborts.
   'action' might see some elements twice!
+  lf_hash_snapshot_iterate() gives a point-in-time view with LF_HASH_MVCC.
 
   @retval 0    ok
   @retval 1    error (action returned 1)
@@ -1276,7 +2743,8 @@ int lf_hash_iterate(LF_HASH *hash, LF_PINS *pins, hash_walk_action action)
   if (el->load() == NULL && unlikely(initialize_bucket(hash, el, bucket, pins)))
     return 0; /* if there's no bucket==0, the hash is empty */
 
-  res= my_lfind(el, 0, 0, 0, &cursor, pins, hash->equal_func, action);
+  LF_WALK walk = {action, lf_hash_element_offset(hash), NULL, NULL};
+  res= my_lfind(el, 0, 0, 0, &cursor, pins, hash->equal_func, &walk);
 
   lf_unpin(pins, 2);
   lf_unpin(pins, 1);
@@ -1286,215 +2754,1773 @@ int lf_hash_iterate(LF_HASH *hash, LF_PINS *pins, hash_walk_action action)
 }
 
 /*
-  only for test
-*/
-/*
-  test lf_dynarray
+  LF_HASH_MVCC: the walk state of lf_hash_snapshot_iterate(). my_lfind()
+  restarts from the head when it loses a race, nodes up to the last
+  hashnr are then skipped and those with the same hashnr remembered.
 */
-void test_lf_dynarray(){
-  using namespace std;
-    LF_DYNARRAY arr;
-    lf_dynarray_init(&arr, sizeof(int));
+#define LF_SNAPSHOT_SEEN 16
+
+struct lf_snapshot_arg {
+  LF_HASH *hash;
+  uint64 snapshot;
+  hash_walk_action *action;
+  uint32 last_hashnr;
+  uint nseen;
+  LF_SLIST *seen[LF_SNAPSHOT_SEEN];
+};
 
-    int * ptr = static_cast<int *>(lf_dynarray_lvalue(&arr, 3)); 
-    *ptr = 0;
-    ++ *ptr;
-    int * ptr2 = static_cast<int *>(lf_dynarray_lvalue(&arr, 3)); 
+static bool lf_snapshot_node(LF_SLIST *node, const uchar *, size_t,
+                             void *arg) {
+  lf_snapshot_arg *scan = static_cast<lf_snapshot_arg *>(arg);
+  LF_VERSIONS *versions = lf_hash_versions(node);
+  uint64 insert_ver, delete_ver;
+  uint i;
 
-    lf_dynarray_destroy(&arr);
+  if (node->hashnr < scan->last_hashnr) {
+    return false;
+  }
+  if (node->hashnr > scan->last_hashnr) {
+    scan->last_hashnr = node->hashnr;
+    scan->nseen = 0;
+  } else {
+    for (i = 0; i < scan->nseen; i++) {
+      if (scan->seen[i] == node) {
+        return false;
+      }
+    }
+  }
+  if (scan->nseen < LF_SNAPSHOT_SEEN) {
+    scan->seen[scan->nseen++] = node;
+  }
+
+  /*
+    A writer may be preempted between linking or claiming the node and
+    stamping it, we don't wait for it but stamp the node ourselves.
+  */
+  insert_ver = lf_hash_stamp(scan->hash, &versions->insert_ver, 0);
+  delete_ver = versions->delete_ver.load();
+  if (delete_ver == LF_VERSION_PENDING) {
+    delete_ver = lf_hash_stamp(scan->hash, &versions->delete_ver,
+                               LF_VERSION_PENDING);
+  }
+  if (insert_ver <= scan->snapshot &&
+      (!delete_ver || delete_ver > scan->snapshot)) {
+    scan->action(lf_hash_element(scan->hash, node));
+  }
+  return false;
 }
 
-/*
-  test lf_hash
-*/
+/**
+  Call 'action' with every element that was in the hash at one moment,
+  concurrently with inserts and deletes (LF_HASH_MVCC only).
 
-struct key_value{
-  ulint key;
-  ulint val;
-};
+  @note
+  The snapshot is the version when the scan starts. Elements inserted
+  later are skipped, elements deleted later are still seen: while a scan
+  runs, deletes keep the nodes in the list and the scan (or another one
+  that ends later) unlinks them when it's done. Every element is seen
+  once, unless more than LF_SNAPSHOT_SEEN elements share a hash value.
 
-// hash function for key
-ulint kv_hash_function(const uchar *key,        /*!< in: value to be hashed */
-                    size_t key_len) /*!< in: hash table size */
-{
-  ulint *tmp = (ulint *)key;
+  @retval 0    ok
+  @retval 1    the hash is empty
+*/
+int lf_hash_snapshot_iterate(LF_HASH *hash, LF_PINS *pins,
+                             hash_walk_action action) {
+  CURSOR cursor;
+  std::atomic<LF_SLIST *> *el;
+  int res = 1;
 
-  return (*tmp) ^ 1653893711;
-}
+  DBUG_ASSERT(hash->flags & LF_HASH_MVCC);
+  hash->snapshots++;
+  /*
+    Publish first, then read the version again and use that: a purge
+    that missed the published value can only have removed versions up
+    to what it read, which is not newer than our snapshot.
+  */
+  pins->snapshot = hash->version.load();
+  lf_snapshot_arg scan = {hash, hash->version.load(), action, 0, 0, {}};
 
-// func for get pointer of key from record
-static const uchar *kv_hash_get_key(const uchar *record, size_t *key_len) {
-  key_value * kv = (key_value *)record;
-  *key_len = sizeof(kv->key); // note that key_len should be assigned
-  ulint *p = (ulint *)(record + offsetof(key_value, key));
-  return record + offsetof(key_value, key);
-}
+  el = find_initialized_bucket(hash, 0);
+  if (likely(el != NULL)) {
+    LF_WALK walk = {NULL, 0, lf_snapshot_node, &scan};
+    my_lfind(el, 0, 0, 0, &cursor, pins, hash->equal_func, &walk);
+    lf_unpin(pins, 2);
+    lf_unpin(pins, 1);
+    lf_unpin(pins, 0);
+    res = 0;
+  }
 
-// func for check whether key1 == key2
-bool kv_hash_equal_func(void *key1, void *key2, size_t key_len){
-  ulint *tmp1 = (ulint *)key1;
-  ulint *tmp2 = (ulint *)key2;
-  return tmp1 == tmp2;
+  pins->snapshot = 0;
+  hash->snapshots--;
+  if (hash->dead.load() > 0) {
+    lf_hash_purge_versions(hash, pins);
+  }
+  return res;
 }
 
-int cnt = 0;
-bool kv_walk_action(void * record){
-  cnt++;
-  // key_value * kv = (key_value *)record;
-  // std::cout << kv->key << "," << kv->val << std::endl;
-  return 0;
-}
+/*
+  lock-free skiplist
 
-/* test for single thread */
-void test_lf_hash(){
-  using namespace std;
+  An ordered index over 64-bit keys, for the range queries that the
+  split-ordered list can't answer (it's ordered by reversed hash).
 
-  /* init a LF_HASH*/
-  LF_HASH m_hash;
-  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0, kv_hash_get_key, &kv_hash_function, &kv_hash_equal_func, NULL, NULL, NULL);
+  A node is linked in levels 0..height-1, level 0 holds all of them and
+  every level above holds about a quarter of the one below. A node is
+  deleted by marking its links from the top level down, the mark on
+  level 0 decides which delete wins; a marked node is unlinked by any
+  thread that walks past it, as in the lists of LF_HASH.
 
-  // get a LF_PINS of m_hash for a thread
-  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  An insert links level 0 first and then raises the node one level at a
+  time, it may still be doing that when a delete unlinks the node. So a
+  node starts with two references, one for the insert and one for the
+  delete, and whoever drops the last one has seen the node unlinked from
+  all levels and frees it through the pinbox.
 
-  // insert an key_value
-  key_value kv1 = {1, 4};
-  lf_hash_insert(&m_hash, pins, &kv1);
-  // insert an key_value
-  key_value kv11 = {3, 4};
-  lf_hash_insert(&m_hash, pins, &kv11);
-    // insert an key_value
-  key_value kv12 = {2, 4};
-  lf_hash_insert(&m_hash, pins, &kv12);
+  Nodes of every height have their own LF_ALLOCATOR, they share the
+  pinbox of the first one. pins[0..2] are used by the walk.
+*/
+#define LF_SKIPLIST_MAX_LEVEL 16
+#define LF_SKIPLIST_BRANCHING 4
+
+struct LF_SKIPNODE {
+  uint64 key; /* the pinbox links the purgatory through it */
+  std::atomic<uint32> refs;
+  uint32 height;
+  /* height links, followed by the element */
+  std::atomic<LF_SKIPNODE *> next[1];
+};
 
-  // search an key_value
-  ulint key1 = 2;
-  key_value *kv2 = (key_value *)lf_hash_search(&m_hash, pins, &key1, sizeof(key1));
-  if(kv2!=nullptr){
-    cout << kv2->key << "," << kv2->val << endl;
-    lf_unpin(pins, 2); // if we found, we need to unpin 2
-  }
-  
+struct LF_SKIPLIST {
+  LF_ALLOCATOR alloc[LF_SKIPLIST_MAX_LEVEL]; /* by height - 1 */
+  LF_SKIPNODE *head;
+  uint element_size;             /* size of memcpy'ed area on insert */
+  uint key_offset;               /* of the uint64 key in the element */
+  std::atomic<uint32> level;     /* the highest level in use */
+  std::atomic<int32> count;      /* number of elements */
+};
 
-  // delete an key_value
-  ulint key2 = 2;
-  lf_hash_delete(&m_hash, pins, &key1, sizeof(key1));
-  key_value *kv3 = (key_value *)lf_hash_search(&m_hash, pins, &key2, sizeof(key2));
-  if(kv3!=nullptr){
-    cout << kv3->key << "," << kv3->val << endl;
-    lf_unpin(pins, 2); // if we found, we need to unpin 2
-  }else{
-    cout << "kv3 is nullptr" << endl;
-  }
-  
-  // iterate all elements
-  lf_hash_iterate(&m_hash, pins, &kv_walk_action);
+/* the pred/curr pair that lf_skiplist_find() leaves at a level */
+typedef struct {
+  LF_SKIPNODE *pred, *curr;
+  uint64 key; /* of curr, if it's not NULL */
+} LF_SKIPLIST_CURSOR;
 
-  // return pins to pinbox
-  lf_pinbox_put_pins(pins);
+typedef bool lf_skiplist_range_action(void *element, void *arg);
 
+#define lf_skiplist_get_pins(SL) lf_pinbox_get_pins(&(SL)->alloc[0].pinbox)
+#define lf_skiplist_put_pins(PINS) lf_pinbox_put_pins(PINS)
+
+static inline size_t lf_skiplist_node_size(uint height) {
+  return offsetof(LF_SKIPNODE, next) +
+         sizeof(std::atomic<LF_SKIPNODE *>) * height;
 }
 
-/* test for multi thread */
+static inline void *lf_skiplist_element(LF_SKIPNODE *node) {
+  return (uchar *)node + lf_skiplist_node_size(node->height);
+}
 
-#include <unistd.h>
-#include <sys/time.h>
+/* pinbox free_func: give nodes back to the allocator of their height */
+static void lf_skiplist_free_nodes(void *v_first, void *v_last,
+                                   void *v_list) {
+  LF_SKIPLIST *sl = static_cast<LF_SKIPLIST *>(v_list);
+  LF_SKIPNODE *node = static_cast<LF_SKIPNODE *>(v_first);
+  for (;;) {
+    LF_SKIPNODE *next =
+        (LF_SKIPNODE *)pnext_node(&sl->alloc[0].pinbox, node);
+    alloc_free(node, node, &sl->alloc[node->height - 1]);
+    if (node == v_last) {
+      break;
+    }
+    node = next;
+  }
+}
 
-LF_HASH m_hash;
+void lf_skiplist_init(LF_SKIPLIST *sl, uint element_size, uint key_offset) {
+  DBUG_ASSERT(key_offset + sizeof(uint64) <= element_size);
+  for (uint i = 0; i < LF_SKIPLIST_MAX_LEVEL; i++) {
+    size_t size = lf_skiplist_node_size(i + 1) + element_size;
+    lf_alloc_init2(&sl->alloc[i], (size + 7) & ~(size_t)7,
+                   offsetof(LF_SKIPNODE, key), NULL, NULL);
+  }
+  sl->alloc[0].pinbox.free_func = lf_skiplist_free_nodes;
+  sl->alloc[0].pinbox.free_func_arg = sl;
+  sl->head = static_cast<LF_SKIPNODE *>(
+      lf_zalloc(lf_skiplist_node_size(LF_SKIPLIST_MAX_LEVEL)));
+  DBUG_ASSERT(sl->head);
+  sl->head->height = LF_SKIPLIST_MAX_LEVEL;
+  sl->element_size = element_size;
+  sl->key_offset = key_offset;
+  sl->level = 1;
+  sl->count = 0;
+}
 
-uint64_t NowMicros() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+void lf_skiplist_destroy(LF_SKIPLIST *sl) {
+  LF_SKIPNODE *el = sl->head->next[0];
+  while (el) {
+    LF_SKIPNODE *next = PTR(el->next[0].load());
+    lf_alloc_direct_free(&sl->alloc[el->height - 1], el);
+    el = next;
+  }
+  lf_free(sl->head);
+  /* the first one owns the pinbox, it may still free nodes to the others */
+  for (uint i = 0; i < LF_SKIPLIST_MAX_LEVEL; i++) {
+    lf_alloc_destroy(&sl->alloc[i]);
+  }
 }
 
-int thread_num = 0;
-int element_num = 10000;
+/*
+  DESCRIPTION
+    Move the cursor along 'level', starting from cursor->pred, to the
+    first node with a key not less than 'key'. Marked nodes on the way
+    are unlinked from this level.
 
-void *func(void *arg) {
-  using namespace std;
+  RETURN
+    0 - positioned, cursor->curr is that node or NULL at the end
+    1 - lost a race (cursor->pred was marked), start over from the head
 
-  // get a LF_PINS of m_hash for a thread
-  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  NOTE
+    cursor->pred must be pinned in pins[2], on return it still is and
+    cursor->curr is pinned in pins[1]
+*/
+static int lf_skiplist_seek(LF_SKIPLIST_CURSOR *cursor, uint level,
+                            uint64 key, LF_PINS *pins) {
+  LF_SKIPNODE *curr, *link, *succ;
+  uint64 cur_key;
 
-  int id = *(int *)&arg;
-  key_value kv1 = {4, 4};
-  for (int i = 0; i < element_num; i++) {
-    kv1 = {i + id, i + id};
+  curr = cursor->pred->next[level];
+  if (DELETED(curr)) {
+    return 1;
+  }
+  lf_pin(pins, 1, curr);
+  if (cursor->pred->next[level] != curr) {
+    return 1;
+  }
+  while (curr) {
+    /*
+      The key is clobbered only after the node is marked on every
+      level, so it's good if the link is read unmarked after it.
+    */
+    cur_key = __atomic_load_n(&curr->key, __ATOMIC_ACQUIRE);
+    link = curr->next[level];
+    succ = PTR(link);
+    lf_pin(pins, 0, succ);
+    if (curr->next[level] != link || cursor->pred->next[level] != curr) {
+      return 1;
+    }
+    if (DELETED(link)) {
+      /* help the delete, the node goes when it's off all levels */
+      if (!atomic_compare_exchange_strong(&cursor->pred->next[level], &curr,
+                                          succ)) {
+        return 1;
+      }
+    } else if (cur_key >= key) {
+      cursor->key = cur_key;
+      break;
+    } else {
+      cursor->pred = curr;
+      lf_pin(pins, 2, curr);
+    }
+    curr = succ;
+    lf_pin(pins, 1, curr);
+  }
+  cursor->curr = curr;
+  return 0;
+}
+
+/*
+  Position the cursor at 'level' before the first node with a key not
+  less than 'key', going down from the highest level. Every marked node
+  with a smaller key (or the same) is unlinked from all levels on the way.
+
+  NOTE
+    pins[0..2] are used, they are NOT removed on return
+*/
+static void lf_skiplist_find(LF_SKIPLIST *sl, uint64 key, uint level,
+                             LF_SKIPLIST_CURSOR *cursor, LF_PINS *pins) {
+retry:
+  cursor->pred = sl->head;
+  lf_pin(pins, 2, sl->head);
+  for (uint l = sl->level.load() - 1;; l--) {
+    if (lf_skiplist_seek(cursor, l, key, pins)) {
+      (void)LF_BACKOFF;
+      goto retry;
+    }
+    if (l <= level) {
+      break;
+    }
+  }
+}
+
+static void lf_skiplist_release(LF_SKIPNODE *node, LF_PINS *pins) {
+  if (node->refs.fetch_sub(1) == 1) {
+    lf_pinbox_free(pins, node);
+  }
+}
+
+/* 1 + a geometric number of levels, 1 / LF_SKIPLIST_BRANCHING each */
+static uint lf_skiplist_random_height() {
+  static thread_local uint64 seed = 0;
+  uint height = 1;
+  if (unlikely(!seed)) {
+    seed = (uint64)(intptr)&seed ^ 0x9E3779B97F4A7C15ULL;
+  }
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  for (uint64 bits = seed; height < LF_SKIPLIST_MAX_LEVEL &&
+                           bits % LF_SKIPLIST_BRANCHING == 0;
+       bits /= LF_SKIPLIST_BRANCHING) {
+    height++;
+  }
+  return height;
+}
+
+/*
+  DESCRIPTION
+    inserts a copy of the element_size bytes at 'data', the key is
+    unique
+
+  RETURN
+    0 - inserted
+    1 - didn't (unique key conflict)
+   -1 - out of memory
+
+  NOTE
+    pins[0..2] are used, on return all pins are removed
+*/
+int lf_skiplist_insert(LF_SKIPLIST *sl, LF_PINS *pins, const void *data) {
+  LF_SKIPLIST_CURSOR cursor;
+  LF_SKIPNODE *node, *link;
+  uint64 key;
+  uint height = lf_skiplist_random_height();
+  uint level;
+
+  memcpy(&key, (const uchar *)data + sl->key_offset, sizeof(key));
+  node = static_cast<LF_SKIPNODE *>(
+      lf_alloc_new_from(&sl->alloc[height - 1], pins));
+  if (unlikely(!node)) {
+    return -1;
+  }
+  node->key = key;
+  node->refs = 2; /* ours and the delete's */
+  node->height = height;
+  memcpy(lf_skiplist_element(node), data, sl->element_size);
+  for (uint i = 1; i < height; i++) {
+    node->next[i] = NULL;
+  }
+  while ((level = sl->level.load()) < height &&
+         !atomic_compare_exchange_weak(&sl->level, &level, height)) {
+  }
+
+  for (;;) {
+    lf_skiplist_find(sl, key, 0, &cursor, pins);
+    if (cursor.curr && cursor.key == key) {
+      lf_unpin(pins, 0);
+      lf_unpin(pins, 1);
+      lf_unpin(pins, 2);
+      lf_pinbox_free(pins, node);
+      return 1;
+    }
+    node->next[0] = cursor.curr;
+    if (atomic_compare_exchange_strong(&cursor.pred->next[0], &cursor.curr,
+                                       node)) {
+      break;
+    }
+  }
+  sl->count++;
+
+  /* raise it, unless a delete has started marking it */
+  for (uint l = 1; l < height; l++) {
+    for (;;) {
+      lf_skiplist_find(sl, key, l, &cursor, pins);
+      link = node->next[l];
+      if (DELETED(link) ||
+          !atomic_compare_exchange_strong(&node->next[l], &link,
+                                          cursor.curr)) {
+        goto done;
+      }
+      if (atomic_compare_exchange_strong(&cursor.pred->next[l],
+                                         &cursor.curr, node)) {
+        break;
+      }
+    }
+  }
+done:
+  /*
+    A delete that marked it after its find may have missed a level we
+    linked since, unlink it once more.
+  */
+  if (DELETED(node->next[0].load())) {
+    lf_skiplist_find(sl, key, 0, &cursor, pins);
+  }
+  lf_skiplist_release(node, pins);
+  lf_unpin(pins, 0);
+  lf_unpin(pins, 1);
+  lf_unpin(pins, 2);
+  return 0;
+}
+
+/*
+  DESCRIPTION
+    deletes the element with the given key
+
+  RETURN
+    0 - deleted
+    1 - didn't (not found)
+
+  NOTE
+    pins[0..2] are used, on return all pins are removed
+*/
+int lf_skiplist_delete(LF_SKIPLIST *sl, LF_PINS *pins, uint64 key) {
+  LF_SKIPLIST_CURSOR cursor;
+  LF_SKIPNODE *node, *link;
+  int res = 1;
+
+  lf_skiplist_find(sl, key, 0, &cursor, pins);
+  node = cursor.curr;
+  if (node && cursor.key == key) {
+    for (uint l = node->height; l-- > 0;) {
+      link = node->next[l];
+      do {
+        if (DELETED(link)) {
+          break;
+        }
+      } while (!atomic_compare_exchange_weak(&node->next[l], &link,
+                                             SET_DELETED(link)));
+      if (l == 0 && DELETED(link)) {
+        goto end; /* another delete has got it */
+      }
+    }
+    /* node is pinned, and the find unlinks it from every level */
+    lf_skiplist_find(sl, key, 0, &cursor, pins);
+    lf_skiplist_release(node, pins);
+    sl->count--;
+    res = 0;
+  }
+end:
+  lf_unpin(pins, 0);
+  lf_unpin(pins, 1);
+  lf_unpin(pins, 2);
+  return res;
+}
+
+/*
+  DESCRIPTION
+    find the element with the given key
+
+  RETURN
+    a pointer to the element or 0 if not found
+
+  NOTE
+    the element is pinned in pins[2], unpin it when done with it.
+    pins[0..2] are used, [0] and [1] are removed on return.
+*/
+void *lf_skiplist_search(LF_SKIPLIST *sl, LF_PINS *pins, uint64 key) {
+  LF_SKIPLIST_CURSOR cursor;
+  void *found = NULL;
+
+  lf_skiplist_find(sl, key, 0, &cursor, pins);
+  if (cursor.curr && cursor.key == key) {
+    lf_pin(pins, 2, cursor.curr);
+    found = lf_skiplist_element(cursor.curr);
+  } else {
+    lf_unpin(pins, 2);
+  }
+  lf_unpin(pins, 0);
+  lf_unpin(pins, 1);
+  return found;
+}
+
+/**
+  Call 'action' with every element with a key in [from, to], in key order.
+
+  @note
+  The scan moves along level 0 and restarts from the last key when it
+  loses a race, each element is seen at most once. Elements inserted or
+  deleted during the scan may or may not be seen.
+  If an 'action' invocation returns true the scan aborts.
+
+  @retval 0    ok
+  @retval 1    aborted by 'action'
+*/
+int lf_skiplist_range(LF_SKIPLIST *sl, LF_PINS *pins, uint64 from,
+                      uint64 to, lf_skiplist_range_action *action,
+                      void *arg) {
+  LF_SKIPLIST_CURSOR cursor;
+  int res = 0;
+
+  lf_skiplist_find(sl, from, 0, &cursor, pins);
+  while (cursor.curr && cursor.key <= to) {
+    if (action(lf_skiplist_element(cursor.curr), arg)) {
+      res = 1;
+      break;
+    }
+    if (cursor.key == to) {
+      break;
+    }
+    from = cursor.key + 1;
+    cursor.pred = cursor.curr;
+    lf_pin(pins, 2, cursor.curr);
+    if (lf_skiplist_seek(&cursor, 0, from, pins)) {
+      lf_skiplist_find(sl, from, 0, &cursor, pins);
+    }
+  }
+  lf_unpin(pins, 0);
+  lf_unpin(pins, 1);
+  lf_unpin(pins, 2);
+  return res;
+}
+
+/*
+  only for test
+*/
+/*
+  test lf_dynarray
+*/
+void test_lf_dynarray(){
+  using namespace std;
+    LF_DYNARRAY arr;
+    lf_dynarray_init(&arr, sizeof(int));
+
+    int * ptr = static_cast<int *>(lf_dynarray_lvalue(&arr, 3)); 
+    *ptr = 0;
+    ++ *ptr;
+    int * ptr2 = static_cast<int *>(lf_dynarray_lvalue(&arr, 3)); 
+
+    lf_dynarray_destroy(&arr);
+}
+
+/*
+  test lf_hash
+*/
+
+struct key_value{
+  ulint key;
+  ulint val;
+};
+
+// hash function for key
+ulint kv_hash_function(const uchar *key,        /*!< in: value to be hashed */
+                    size_t key_len) /*!< in: hash table size */
+{
+  ulint *tmp = (ulint *)key;
+
+  return (*tmp) ^ 1653893711;
+}
+
+/* the hash functions -H can pick for the key_value tests */
+struct named_hash_func {
+  const char *name;
+  lf_hash_func *func;
+};
+
+static const named_hash_func kv_hashes[] = {
+    {"xor", kv_hash_function},
+    {"murmur", fast_hash_murmur},
+    {"wy", fast_hash_wy},
+    {"crc32", fast_hash_crc32},
+};
+
+lf_hash_func *kv_hash = kv_hash_function;
+
+// func for get pointer of key from record
+static const uchar *kv_hash_get_key(const uchar *record, size_t *key_len) {
+  key_value * kv = (key_value *)record;
+  *key_len = sizeof(kv->key); // note that key_len should be assigned
+  ulint *p = (ulint *)(record + offsetof(key_value, key));
+  return record + offsetof(key_value, key);
+}
+
+// func for check whether key1 == key2
+bool kv_hash_equal_func(void *key1, void *key2, size_t key_len){
+  ulint *tmp1 = (ulint *)key1;
+  ulint *tmp2 = (ulint *)key2;
+  return *tmp1 == *tmp2;
+}
+
+int cnt = 0;
+bool kv_walk_action(void * record){
+  cnt++;
+  // key_value * kv = (key_value *)record;
+  // std::cout << kv->key << "," << kv->val << std::endl;
+  return 0;
+}
+
+/* test for single thread */
+void test_lf_hash(){
+  using namespace std;
+
+  /* init a LF_HASH*/
+  LF_HASH m_hash;
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0, kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL, NULL, NULL);
+
+  // get a LF_PINS of m_hash for a thread
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+
+  // insert an key_value
+  key_value kv1 = {1, 4};
+  lf_hash_insert(&m_hash, pins, &kv1);
+  // insert an key_value
+  key_value kv11 = {3, 4};
+  lf_hash_insert(&m_hash, pins, &kv11);
+    // insert an key_value
+  key_value kv12 = {2, 4};
+  lf_hash_insert(&m_hash, pins, &kv12);
+
+  // search an key_value
+  ulint key1 = 2;
+  key_value *kv2 = (key_value *)lf_hash_search(&m_hash, pins, &key1, sizeof(key1));
+  if(kv2!=nullptr){
+    cout << kv2->key << "," << kv2->val << endl;
+    lf_unpin(pins, 2); // if we found, we need to unpin 2
+  }
+  
+
+  // delete an key_value
+  ulint key2 = 2;
+  lf_hash_delete(&m_hash, pins, &key1, sizeof(key1));
+  key_value *kv3 = (key_value *)lf_hash_search(&m_hash, pins, &key2, sizeof(key2));
+  if(kv3!=nullptr){
+    cout << kv3->key << "," << kv3->val << endl;
+    lf_unpin(pins, 2); // if we found, we need to unpin 2
+  }else{
+    cout << "kv3 is nullptr" << endl;
+  }
+  
+  // iterate all elements
+  lf_hash_iterate(&m_hash, pins, &kv_walk_action);
+
+  // return pins to pinbox
+  lf_pinbox_put_pins(pins);
+
+}
+
+/* test for multi thread */
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <map>
+
+LF_HASH m_hash;
+
+uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+int thread_num = 16;
+int element_num = 10000;
+uint hash_flags = 0;
+
+void *func(void *arg) {
+  using namespace std;
+
+  // get a LF_PINS of m_hash for a thread
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+
+  int id = *(int *)&arg;
+  key_value kv1 = {4, 4};
+  for (int i = 0; i < element_num; i++) {
+    kv1 = {i + id, i + id};
     // printf("i %d\n", i);
     lf_hash_insert(&m_hash, pins, &kv1);
   }
-  // // insert an key_value
-  // key_value kv1 = {4, 4};
-  // // insert an key_value
-  // key_value kv11 = {2, 4};
-  // lf_hash_insert(&m_hash, pins, &kv11);
-  //   // insert an key_value
-  // key_value kv12 = {3, 4};
-  // lf_hash_insert(&m_hash, pins, &kv12);
+  // // insert an key_value
+  // key_value kv1 = {4, 4};
+  // // insert an key_value
+  // key_value kv11 = {2, 4};
+  // lf_hash_insert(&m_hash, pins, &kv11);
+  //   // insert an key_value
+  // key_value kv12 = {3, 4};
+  // lf_hash_insert(&m_hash, pins, &kv12);
+
+  // // search an key_value
+  // ulint key1 = 2;
+  // key_value *kv2 = (key_value *)lf_hash_search(&m_hash, pins, &key1, sizeof(key1));
+  // if(kv2!=nullptr){
+  //   cout << "t2: " <<  kv2->key << "," << kv2->val << endl;
+  //   lf_unpin(pins, 2); // if we found, we need to unpin 2
+  // }
+  
+
+  // // delete an key_value
+  // ulint key2 = 2;
+  // lf_hash_delete(&m_hash, pins, &key1, sizeof(key1));
+  // key_value *kv3 = (key_value *)lf_hash_search(&m_hash, pins, &key2, sizeof(key2));
+  // if(kv3!=nullptr){
+  //   cout << "t2: " << kv3->key << "," << kv3->val << endl;
+  //   lf_unpin(pins, 2); // if we found, we need to unpin 2
+  // }else{
+  //   cout << "t2: " << "kv3 is nullptr" << endl;
+  // }
+
+  // return pins to pinbox
+  lf_pinbox_put_pins(pins);
+
+  return NULL;
+}
+
+
+void test_lf_hash_mutilthreads(){
+
+  using namespace std;
+  /* init a LF_HASH*/
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE | hash_flags, 0, 0, kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL, NULL, NULL);
+
+  pthread_t tid[thread_num];
+
+  uint64_t st, ed;
+  st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, func, (void *)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+
+  ed = NowMicros();
+
+  printf("insert %lld elements, time cost %lld us\n", (uint64_t)thread_num * (uint64_t)element_num, ed - st);
+
+/*
+ *   // get a LF_PINS of m_hash for a thread
+ *   LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+ * 
+ *   lf_hash_iterate(&m_hash, pins, &kv_walk_action);
+ * 
+ *   // return pins to pinbox
+ *   lf_pinbox_put_pins(pins);
+ */
+
+}
+
+
+/*
+  false sharing test: every thread inserts, finds and deletes its own
+  keys over and over, so the nodes are recycled through the allocator
+  stack and neighbouring nodes end up being written by different threads
+*/
+void *false_sharing_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint id = (ulint)arg;
+
+  for (int i = 0; i < element_num; i++) {
+    key_value kv = {(ulint)i * thread_num + id, (ulint)i};
+    lf_hash_insert(&m_hash, pins, &kv);
+    key_value *found =
+        (key_value *)lf_hash_search(&m_hash, pins, &kv.key, sizeof(kv.key));
+    assert(found && found->val == kv.val);
+    lf_unpin(pins, 2);
+    lf_hash_delete(&m_hash, pins, &kv.key, sizeof(kv.key));
+  }
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+void test_lf_hash_false_sharing(uint flags) {
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE | flags, 0, 0,
+                kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL,
+                NULL, NULL);
+
+  pthread_t tid[thread_num];
+
+  uint64_t st, ed;
+  st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, false_sharing_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+
+  printf("%s nodes of %u bytes: insert/search/delete %llu elements, "
+         "time cost %llu us\n",
+         (flags & LF_HASH_ALIGN_NODES) ? "aligned" : "unaligned",
+         m_hash.alloc.element_size,
+         (unsigned long long)thread_num * element_num,
+         (unsigned long long)(ed - st));
+
+  lf_hash_destroy(&m_hash);
+}
+
+/*
+  reclaimer test: the false sharing churn with and without a background
+  reclaimer. All elements are deleted in the end, so every node that was
+  malloc'ed must be back on the allocator stack or still waiting in the
+  handoff list
+*/
+static uint handoff_count(LF_PINBOX *pinbox) {
+  uint n = 0;
+  for (void *node = pinbox->handoff; node; node = pnext_node(pinbox, node)) {
+    n++;
+  }
+  return n;
+}
+
+void test_lf_hash_reclaimer(bool reclaimer) {
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0,
+                kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL,
+                NULL, NULL);
+  LF_PINBOX *pinbox = &m_hash.alloc.pinbox;
+  if (reclaimer) {
+    int res = lf_pinbox_start_reclaimer(pinbox);
+    assert(res == 0);
+    res = lf_pinbox_start_reclaimer(pinbox);
+    assert(res == -1); /* already running */
+  }
+
+  pthread_t tid[thread_num];
+
+  uint64_t st, ed;
+  st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, false_sharing_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+  lf_pinbox_stop_reclaimer(pinbox);
+
+  uint free_nodes = lf_alloc_pool_count(&m_hash.alloc) + handoff_count(pinbox);
+  assert(m_hash.count == 0);
+  assert(free_nodes == m_hash.alloc.mallocs);
+  printf("%s reclaimer: insert/search/delete %llu elements, "
+         "time cost %llu us, %u nodes malloc'ed\n",
+         reclaimer ? "background" : "no",
+         (unsigned long long)thread_num * element_num,
+         (unsigned long long)(ed - st), free_nodes);
+
+  lf_hash_destroy(&m_hash);
+}
+
+/*
+  intrusive test: the elements embed their LF_SLIST and belong to the
+  test. Every thread inserts its elements, looks them up and deletes
+  every other one while the other threads search the same keys. The
+  reclaim callback must see every element exactly once: the deleted ones
+  once nobody has them pinned, the rest from lf_hash_destroy()
+*/
+struct intrusive_value {
+  ulint key; /* first, kv_hash_get_key() reads it */
+  ulint val;
+  std::atomic<uint32> reclaimed;
+  LF_SLIST hook;
+};
+
+intrusive_value *m_intrusive;
+std::atomic<uint64> m_reclaimed;
+
+static void intrusive_reclaim(void *element, void *arg) {
+  intrusive_value *iv = (intrusive_value *)element;
+  assert(arg == m_intrusive);
+  uint32 before = iv->reclaimed.fetch_add(1);
+  assert(before == 0);
+  m_reclaimed++;
+}
+
+void *intrusive_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint id = (ulint)arg;
+
+  for (int i = 0; i < element_num; i++) {
+    ulint key = (ulint)i * thread_num + id;
+    intrusive_value *iv = &m_intrusive[key];
+    int res = lf_hash_insert(&m_hash, pins, iv);
+    assert(res == 0);
+  }
+  for (int i = 0; i < element_num; i++) {
+    ulint key = (ulint)i * thread_num + id;
+    /* the element itself is found, not a copy */
+    void *found = lf_hash_search(&m_hash, pins, &key, sizeof(key));
+    assert(found == &m_intrusive[key]);
+    lf_unpin(pins, 2);
+    if (i % 2) {
+      int res = lf_hash_delete(&m_hash, pins, &key, sizeof(key));
+      assert(res == 0);
+    }
+    /* a neighbour's key, which may be deleted under us */
+    ulint other = (key + 1) % ((ulint)thread_num * element_num);
+    intrusive_value *iv =
+        (intrusive_value *)lf_hash_search(&m_hash, pins, &other, sizeof(other));
+    assert(!iv || (iv == &m_intrusive[other] && iv->val == other));
+    lf_unpin(pins, 2);
+  }
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+void test_lf_hash_intrusive() {
+  ulint n = (ulint)thread_num * element_num;
+  m_intrusive = new intrusive_value[n];
+  for (ulint key = 0; key < n; key++) {
+    m_intrusive[key].key = key;
+    m_intrusive[key].val = key;
+    m_intrusive[key].reclaimed = 0;
+  }
+  m_reclaimed = 0;
+  lf_hash_init_intrusive(&m_hash, offsetof(intrusive_value, hook),
+                         LF_HASH_UNIQUE, 0, 0, kv_hash_get_key, kv_hash,
+                         &kv_hash_equal_func, intrusive_reclaim, m_intrusive);
+
+  pthread_t tid[thread_num];
+
+  uint64_t st, ed;
+  st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, intrusive_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+
+  /* only deleted elements can have been reclaimed so far */
+  uint64 deleted = n - m_hash.count;
+  uint64 reclaimed = m_reclaimed;
+  assert(deleted == (uint64)thread_num * (element_num / 2));
+  assert(reclaimed <= deleted);
+  lf_hash_destroy(&m_hash);
+  assert(m_reclaimed == n);
+  for (ulint key = 0; key < n; key++) {
+    assert(m_intrusive[key].reclaimed == 1);
+  }
+
+  printf("intrusive: insert/search/delete %lu elements, time cost %llu us, "
+         "%llu of %llu deleted reclaimed before destroy\n",
+         n, (unsigned long long)(ed - st), (unsigned long long)reclaimed,
+         (unsigned long long)deleted);
+  delete[] m_intrusive;
+}
+
+/*
+  fixed capacity test: every thread inserts, searches and deletes its
+  keys for FIXED_ROUNDS rounds, with lf_hash_set_fixed_capacity() or
+  without. A fixed hash must never malloc past its preallocation, and
+  once the churn is over exactly its capacity must fit in again
+*/
+#define FIXED_ROUNDS 4
+
+void *fixed_capacity_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint id = (ulint)arg;
+
+  for (int round = 0; round < FIXED_ROUNDS; round++) {
+    for (int i = 0; i < element_num; i++) {
+      key_value kv = {(ulint)i * thread_num + id, (ulint)round};
+      int res = lf_hash_insert(&m_hash, pins, &kv);
+      assert(res == 0);
+    }
+    for (int i = 0; i < element_num; i++) {
+      ulint key = (ulint)i * thread_num + id;
+      key_value *found =
+          (key_value *)lf_hash_search(&m_hash, pins, &key, sizeof(key));
+      assert(found && found->val == (ulint)round);
+      lf_unpin(pins, 2);
+      int res = lf_hash_delete(&m_hash, pins, &key, sizeof(key));
+      assert(res == 0);
+    }
+  }
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+void test_lf_hash_fixed_capacity(bool fixed) {
+  ulint n = (ulint)thread_num * element_num;
+  /* deleted nodes wait in the purgatories, up to a full one per thread */
+  uint capacity = n + (ulint)thread_num * LF_PURGATORY_SIZE;
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0,
+                kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL,
+                NULL, NULL);
+  int locked = 0;
+  uint dummies = 0;
+  if (fixed) {
+    locked = lf_hash_set_fixed_capacity(&m_hash, capacity, n, true);
+    assert(locked >= 0);
+    dummies = m_hash.dummies->mallocs;
+  }
+
+  pthread_t tid[thread_num];
+
+  uint64_t st, ed;
+  st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, fixed_capacity_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+
+  assert(m_hash.count == 0);
+  uint mallocs = m_hash.alloc.mallocs;
+  printf("%s: insert/search/delete %llu elements %d times, "
+         "time cost %llu us, %u nodes malloc'ed\n",
+         fixed ? (locked ? "fixed capacity (not locked)" : "fixed capacity")
+               : "growing",
+         (unsigned long long)n, FIXED_ROUNDS, (unsigned long long)(ed - st),
+         mallocs);
+
+  if (fixed) {
+    /* no malloc past the preallocation, for nodes or dummies */
+    assert(mallocs == capacity);
+    assert(m_hash.dummies->mallocs == dummies);
+
+    /* every node came back: capacity elements fit, one more doesn't */
+    LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+    for (ulint key = 0; key < capacity; key++) {
+      key_value kv = {key, key};
+      int res = lf_hash_insert(&m_hash, pins, &kv);
+      assert(res == 0);
+    }
+    key_value kv = {capacity, capacity};
+    int res = lf_hash_insert(&m_hash, pins, &kv);
+    assert(res == -1);
+    assert(m_hash.alloc.mallocs == capacity);
+    assert(m_hash.dummies->mallocs == dummies);
+    lf_pinbox_put_pins(pins);
+  }
+
+  lf_hash_destroy(&m_hash);
+}
+
+/*
+  snapshot test: half of the threads replace the keys 0..n-1 by n..2n-1,
+  each deleter going up its own keys and inserting key + n after deleting
+  key, while the other half scans snapshots. A snapshot is a point in
+  time, so for every deleter it must hold the deleter's keys from some
+  step on and the replacements below that step, or one less if it fell
+  between the delete and the insert, and no element twice
+*/
+int m_deleters;
+std::atomic<bool> m_deleting;
+std::atomic<ulint> m_replaced;
+
+static thread_local uchar *m_snapshot_seen;
+
+static bool snapshot_seen_action(void *element) {
+  ulint key = ((key_value *)element)->key;
+  assert(!m_snapshot_seen[key]);
+  m_snapshot_seen[key] = 1;
+  return false;
+}
+
+/* returns true if the snapshot caught the replacement half way */
+static bool check_snapshot(ulint n) {
+  bool old_keys = false, new_keys = false;
+  for (int t = 0; t < m_deleters; t++) {
+    ulint steps = (n - t + m_deleters - 1) / m_deleters;
+    ulint kept = steps, inserted = steps;
+    for (ulint i = steps; i--;) {
+      if (!m_snapshot_seen[i * m_deleters + t]) {
+        break;
+      }
+      kept = i;
+    }
+    for (ulint i = 0; i < steps; i++) {
+      if (!m_snapshot_seen[n + i * m_deleters + t]) {
+        inserted = i;
+        break;
+      }
+    }
+    for (ulint i = 0; i < steps; i++) {
+      assert(m_snapshot_seen[i * m_deleters + t] == (i >= kept));
+      assert(m_snapshot_seen[n + i * m_deleters + t] == (i < inserted));
+    }
+    assert(inserted == kept || inserted + 1 == kept);
+    old_keys |= kept < steps;
+    new_keys |= inserted > 0;
+  }
+  return old_keys && new_keys;
+}
+
+void *snapshot_delete_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint id = (ulint)arg;
+  ulint n = (ulint)thread_num * element_num;
+
+  for (ulint key = id; key < n; key += m_deleters) {
+    int res = lf_hash_delete(&m_hash, pins, &key, sizeof(key));
+    assert(res == 0);
+    key_value kv = {key + n, key + n};
+    res = lf_hash_insert(&m_hash, pins, &kv);
+    assert(res == 0);
+    m_replaced++;
+  }
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+void *snapshot_scan_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint n = (ulint)thread_num * element_num;
+  ulint *scans = (ulint *)arg; /* all of them, and those half way */
+
+  m_snapshot_seen = static_cast<uchar *>(lf_alloc(2 * n));
+  /* a snapshot before the first replacement proves nothing */
+  while (!m_replaced) {
+    lf_thread_yield;
+  }
+  do {
+    memset(m_snapshot_seen, 0, 2 * n);
+    lf_hash_snapshot_iterate(&m_hash, pins, snapshot_seen_action);
+    scans[1] += check_snapshot(n);
+    scans[0]++;
+  } while (m_deleting);
+  lf_free(m_snapshot_seen);
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+static ulint m_iterated;
+
+static bool count_action(void *) {
+  m_iterated++;
+  return false;
+}
+
+void test_lf_hash_snapshot() {
+  ulint n = (ulint)thread_num * element_num;
+  int scanners = lf_max(thread_num / 2, 1);
+  m_deleters = lf_max(thread_num - scanners, 1);
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE | LF_HASH_MVCC,
+                0, 0, kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL,
+                NULL, NULL);
+
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  for (ulint key = 0; key < n; key++) {
+    key_value kv = {key, key};
+    lf_hash_insert(&m_hash, pins, &kv);
+  }
 
-  // // search an key_value
-  // ulint key1 = 2;
-  // key_value *kv2 = (key_value *)lf_hash_search(&m_hash, pins, &key1, sizeof(key1));
-  // if(kv2!=nullptr){
-  //   cout << "t2: " <<  kv2->key << "," << kv2->val << endl;
-  //   lf_unpin(pins, 2); // if we found, we need to unpin 2
-  // }
-  
+  pthread_t tid[m_deleters + scanners];
+  ulint scans[scanners][2];
 
-  // // delete an key_value
-  // ulint key2 = 2;
-  // lf_hash_delete(&m_hash, pins, &key1, sizeof(key1));
-  // key_value *kv3 = (key_value *)lf_hash_search(&m_hash, pins, &key2, sizeof(key2));
-  // if(kv3!=nullptr){
-  //   cout << "t2: " << kv3->key << "," << kv3->val << endl;
-  //   lf_unpin(pins, 2); // if we found, we need to unpin 2
-  // }else{
-  //   cout << "t2: " << "kv3 is nullptr" << endl;
-  // }
+  uint64_t st, ed;
+  m_deleting = true;
+  m_replaced = 0;
+  st = NowMicros();
+  for (int i = 0; i < scanners; i++) {
+    scans[i][0] = scans[i][1] = 0;
+    pthread_create(&tid[m_deleters + i], NULL, snapshot_scan_func, scans[i]);
+  }
+  for (int i = 0; i < m_deleters; i++) {
+    pthread_create(&tid[i], NULL, snapshot_delete_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < m_deleters; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  ed = NowMicros();
+  m_deleting = false;
+  ulint total_scans = 0, torn_scans = 0;
+  for (int i = 0; i < scanners; i++) {
+    pthread_join(tid[m_deleters + i], NULL);
+    total_scans += scans[i][0];
+    torn_scans += scans[i][1];
+  }
+
+  /* with no scan running every deleted node can be unlinked */
+  lf_hash_purge_versions(&m_hash, pins);
+  assert(m_hash.dead == 0);
+  m_iterated = 0;
+  lf_hash_iterate(&m_hash, pins, count_action);
+  assert(m_iterated == n && m_hash.count == (int32)n);
+
+  printf("snapshot: replace %lu elements by %d threads, time cost %llu us, "
+         "%lu consistent snapshots by %d threads (%lu half way)\n",
+         n, m_deleters, (unsigned long long)(ed - st), total_scans, scanners,
+         torn_scans);
 
-  // return pins to pinbox
   lf_pinbox_put_pins(pins);
+  lf_hash_destroy(&m_hash);
+}
+
+/*
+  string key test: keys of 16..128 bytes, either kept in a separate
+  allocation per key that the element points to, or copied into the
+  node with LF_HASH_INLINE_KEYS
+*/
+struct str_value {
+  const char *key;
+  size_t keylen;
+  ulint val;
+};
 
+ulint str_hash_function(const uchar *key, size_t key_len) {
+  ulint h = 14695981039346656037ULL; /* FNV-1a */
+  for (size_t i = 0; i < key_len; i++) {
+    h = (h ^ key[i]) * 1099511628211ULL;
+  }
+  return h;
 }
 
+static const uchar *str_hash_get_key(const uchar *record, size_t *key_len) {
+  str_value *sv = (str_value *)record;
+  *key_len = sv->keylen;
+  return (const uchar *)sv->key;
+}
 
-void test_lf_hash_mutilthreads(){
+bool str_hash_equal_func(void *key1, void *key2, size_t key_len) {
+  return memcmp(key1, key2, key_len) == 0;
+}
 
-  using namespace std;
-  /* init a LF_HASH*/
-  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0, kv_hash_get_key, &kv_hash_function, &kv_hash_equal_func, NULL, NULL, NULL);
+static size_t make_str_key(char *buf, ulint n) {
+  size_t len = 16 + n * 7 % 113; /* 16..128 bytes */
+  int prefix = snprintf(buf, len + 1, "%lu:", n);
+  memset(buf + prefix, 'a' + n % 26, len - prefix);
+  buf[len] = 0;
+  return len;
+}
+
+void *str_key_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  bool inline_keys = m_hash.flags & LF_HASH_INLINE_KEYS;
+  ulint id = (ulint)arg;
+  char buf[LF_HASH_MAX_INLINE_KEY + 1];
+
+  for (int i = 0; i < element_num; i++) {
+    ulint n = (ulint)i * thread_num + id;
+    str_value sv = {buf, make_str_key(buf, n), n};
+    if (!inline_keys) {
+      /* the separate key allocation, never reclaimed by the hash */
+      sv.key = strdup(buf);
+    }
+    lf_hash_insert(&m_hash, pins, &sv);
+  }
+  for (int i = 0; i < element_num; i++) {
+    ulint n = (ulint)i * thread_num + id;
+    size_t len = make_str_key(buf, n);
+    str_value *found = (str_value *)lf_hash_search(&m_hash, pins, buf, len);
+    assert(found && found->val == n);
+    lf_unpin(pins, 2);
+  }
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+static bool free_str_key(void *record) {
+  free((void *)((str_value *)record)->key);
+  return 0;
+}
+
+void test_lf_hash_str_keys(uint flags) {
+  lf_hash_init2(&m_hash, sizeof(str_value), LF_HASH_UNIQUE | flags, 0, 0,
+                str_hash_get_key, &str_hash_function, &str_hash_equal_func,
+                NULL, NULL, NULL);
 
-  
-  thread_num = 16;
   pthread_t tid[thread_num];
 
   uint64_t st, ed;
   st = NowMicros();
   for (int i = 0; i < thread_num; i++) {
-    pthread_create(&tid[i], NULL, func, (void *)i);
+    pthread_create(&tid[i], NULL, str_key_func, (void *)(ulint)i);
   }
   for (int i = 0; i < thread_num; i++) {
     pthread_join(tid[i], NULL);
   }
+  ed = NowMicros();
+
+  printf("%s keys: insert and search %llu string keys, time cost %llu us\n",
+         (flags & LF_HASH_INLINE_KEYS) ? "inline" : "separate",
+         (unsigned long long)thread_num * element_num,
+         (unsigned long long)(ed - st));
+
+  if (!(flags & LF_HASH_INLINE_KEYS)) {
+    LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+    lf_hash_iterate(&m_hash, pins, free_str_key);
+    lf_pinbox_put_pins(pins);
+  }
+  lf_hash_destroy(&m_hash);
+}
+
+/*
+  bloom filter test: search for element_num keys that are there and
+  element_num * 4 that are not, with and without the filter
+*/
+void *bloom_search_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint id = (ulint)arg;
+
+  for (int i = 0; i < element_num * 5; i++) {
+    ulint key = (ulint)i * thread_num + id;
+    key_value *found =
+        (key_value *)lf_hash_search(&m_hash, pins, &key, sizeof(key));
+    assert((found != NULL) == (i < element_num));
+    lf_unpin(pins, 2);
+  }
+
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+static void bloom_search(const char *what) {
+  pthread_t tid[thread_num];
 
+  uint64_t st, ed;
+  st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, bloom_search_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
   ed = NowMicros();
 
-  printf("insert %lld elements, time cost %lld us\n", (uint64_t)thread_num * (uint64_t)element_num, ed - st);
+  printf("%s: search %llu elements (80%% misses), time cost %llu us",
+         what, (unsigned long long)thread_num * element_num * 5,
+         (unsigned long long)(ed - st));
+  if (m_hash.flags & LF_HASH_BLOOM) {
+    printf(", false positive rate %.4f", lf_hash_bloom_fp_rate(&m_hash));
+  }
+  printf("\n");
+}
+
+void test_lf_hash_bloom(bool bloom) {
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0,
+                kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL,
+                NULL, NULL);
+  if (bloom) {
+    /* sized for a tenth of the keys, so that it overfills */
+    lf_hash_bloom_init(&m_hash, (uint64)thread_num * element_num / 10);
+  }
+
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  for (ulint key = 0; key < (ulint)thread_num * element_num; key++) {
+    key_value kv = {key, key};
+    lf_hash_insert(&m_hash, pins, &kv);
+  }
+
+  bloom_search(bloom ? "bloom" : "no bloom");
+  if (bloom) {
+    lf_hash_bloom_rebuild(&m_hash, pins);
+    bloom_search("rebuilt bloom");
+  }
+
+  lf_pinbox_put_pins(pins);
+  lf_hash_destroy(&m_hash);
+}
 
 /*
- *   // get a LF_PINS of m_hash for a thread
- *   LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
- * 
- *   lf_hash_iterate(&m_hash, pins, &kv_walk_action);
- * 
- *   // return pins to pinbox
- *   lf_pinbox_put_pins(pins);
- */
+  batch delete test: every thread deletes its keys, one lf_hash_delete()
+  per key or delete_batch keys per lf_hash_delete_batch()
+*/
+static uint delete_batch;
+
+void *delete_func(void *arg) {
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  ulint id = (ulint)arg;
+  ulint *keys = static_cast<ulint *>(lf_alloc(sizeof(ulint) * delete_batch));
+  const void **key_ptrs = static_cast<const void **>(
+      lf_alloc(sizeof(void *) * delete_batch));
+  uint *keylens = static_cast<uint *>(lf_alloc(sizeof(uint) * delete_batch));
+
+  for (int i = 0; i < element_num; i += delete_batch) {
+    uint n = element_num - i < (int)delete_batch ? element_num - i
+                                                  : delete_batch;
+    for (uint j = 0; j < n; j++) {
+      keys[j] = (ulint)(i + j) * thread_num + id;
+      key_ptrs[j] = &keys[j];
+      keylens[j] = sizeof(ulint);
+    }
+    if (delete_batch == 1) {
+      int res = lf_hash_delete(&m_hash, pins, key_ptrs[0], keylens[0]);
+      assert(res == 0);
+    } else {
+      int res = lf_hash_delete_batch(&m_hash, pins, key_ptrs, keylens, n);
+      assert(res == (int)n);
+    }
+  }
+  lf_free(keylens);
+  lf_free(key_ptrs);
+  lf_free(keys);
+  lf_pinbox_put_pins(pins);
+  return NULL;
+}
+
+void test_lf_hash_delete_batch(uint batch) {
+  lf_hash_init2(&m_hash, sizeof(key_value), LF_HASH_UNIQUE, 0, 0,
+                kv_hash_get_key, kv_hash, &kv_hash_equal_func, NULL,
+                NULL, NULL);
+
+  LF_PINS *pins = lf_pinbox_get_pins(&m_hash.alloc.pinbox);
+  for (ulint key = 0; key < (ulint)thread_num * element_num; key++) {
+    key_value kv = {key, key};
+    lf_hash_insert(&m_hash, pins, &kv);
+  }
+
+  delete_batch = batch;
+  pthread_t tid[thread_num];
+  uint64_t st = NowMicros();
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, delete_func, (void *)(ulint)i);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  uint64_t ed = NowMicros();
+
+  /* every key is gone, and only once */
+  assert(m_hash.count == 0);
+  for (ulint key = 0; key < (ulint)thread_num * element_num; key++) {
+    assert(!lf_hash_search(&m_hash, pins, &key, sizeof(key)));
+    lf_unpin(pins, 2);
+  }
+  printf("delete %llu elements, batch %u, time cost %llu us\n",
+         (unsigned long long)thread_num * element_num, batch,
+         (unsigned long long)(ed - st));
+
+  lf_pinbox_put_pins(pins);
+  lf_hash_destroy(&m_hash);
+}
+
+/*
+  ordered index test: every thread inserts its keys, looks them up, scans
+  ranges of RANGE_SCAN_KEYS keys and deletes its keys again, in an
+  lf_skiplist and in a std::map behind one global mutex
+*/
+#define RANGE_SCAN_KEYS 100
+
+enum index_op { INDEX_INSERT, INDEX_SEARCH, INDEX_RANGE, INDEX_DELETE };
+static const char *index_op_names[] = {"insert", "search", "range scan",
+                                       "delete"};
+
+LF_SKIPLIST m_skiplist;
+std::map<ulint, ulint> m_map;
+pthread_mutex_t m_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+index_op m_index_op;
+
+static bool count_range_action(void *, void *arg) {
+  (*(ulint *)arg)++;
+  return false;
+}
+
+void *skiplist_func(void *arg) {
+  LF_PINS *pins = lf_skiplist_get_pins(&m_skiplist);
+  ulint id = (ulint)arg;
+
+  for (int i = 0; i < element_num; i++) {
+    key_value kv = {(ulint)i * thread_num + id, (ulint)i};
+    switch (m_index_op) {
+      case INDEX_INSERT:
+        lf_skiplist_insert(&m_skiplist, pins, &kv);
+        break;
+      case INDEX_SEARCH: {
+        key_value *found =
+            (key_value *)lf_skiplist_search(&m_skiplist, pins, kv.key);
+        assert(found && found->val == kv.val);
+        lf_unpin(pins, 2);
+        break;
+      }
+      case INDEX_RANGE: {
+        ulint n = 0;
+        lf_skiplist_range(&m_skiplist, pins, kv.key,
+                          kv.key + RANGE_SCAN_KEYS - 1, count_range_action,
+                          &n);
+        assert(n && n <= RANGE_SCAN_KEYS);
+        break;
+      }
+      case INDEX_DELETE:
+        lf_skiplist_delete(&m_skiplist, pins, kv.key);
+        break;
+    }
+  }
+
+  lf_skiplist_put_pins(pins);
+  return NULL;
+}
+
+void *std_map_func(void *arg) {
+  ulint id = (ulint)arg;
+
+  for (int i = 0; i < element_num; i++) {
+    key_value kv = {(ulint)i * thread_num + id, (ulint)i};
+    pthread_mutex_lock(&m_map_mutex);
+    switch (m_index_op) {
+      case INDEX_INSERT:
+        m_map.insert(std::make_pair(kv.key, kv.val));
+        break;
+      case INDEX_SEARCH: {
+        std::map<ulint, ulint>::iterator it = m_map.find(kv.key);
+        assert(it != m_map.end() && it->second == kv.val);
+        break;
+      }
+      case INDEX_RANGE: {
+        ulint n = 0;
+        std::map<ulint, ulint>::iterator it = m_map.lower_bound(kv.key);
+        for (; it != m_map.end() && it->first < kv.key + RANGE_SCAN_KEYS;
+             ++it) {
+          n++;
+        }
+        assert(n && n <= RANGE_SCAN_KEYS);
+        break;
+      }
+      case INDEX_DELETE:
+        m_map.erase(kv.key);
+        break;
+    }
+    pthread_mutex_unlock(&m_map_mutex);
+  }
+  return NULL;
+}
+
+void test_ordered_index(bool skiplist) {
+  if (skiplist) {
+    lf_skiplist_init(&m_skiplist, sizeof(key_value),
+                     offsetof(key_value, key));
+  }
+
+  pthread_t tid[thread_num];
+
+  for (int op = INDEX_INSERT; op <= INDEX_DELETE; op++) {
+    m_index_op = (index_op)op;
+    uint64_t st, ed;
+    st = NowMicros();
+    for (int i = 0; i < thread_num; i++) {
+      pthread_create(&tid[i], NULL, skiplist ? skiplist_func : std_map_func,
+                     (void *)(ulint)i);
+    }
+    for (int i = 0; i < thread_num; i++) {
+      pthread_join(tid[i], NULL);
+    }
+    ed = NowMicros();
+
+    printf("%s: %s %llu elements, time cost %llu us\n",
+           skiplist ? "lf_skiplist" : "std::map + mutex", index_op_names[op],
+           (unsigned long long)thread_num * element_num,
+           (unsigned long long)(ed - st));
+  }
+
+  if (skiplist) {
+    assert(m_skiplist.count == 0);
+    lf_skiplist_destroy(&m_skiplist);
+  }
+}
+
+/*
+  hash distribution test: how LF_HASH would spread element_num * thread_num
+  keys over its buckets (a power of two of them, at the default load of
+  one element per bucket) with every hash function, and how fast each
+  one hashes. 'skew' is the average chain length seen by a search divided
+  by that of a perfectly random hash: 1.00 is what a good hash gets on
+  any keys, below that the keys happen to spread more evenly than random.
+*/
+static const char *kv_key_set_names[] = {"sequential", "stride 2^16",
+                                         "interleaved"};
+
+static ulint kv_key_of(int key_set, ulint i) {
+  switch (key_set) {
+    case 0:
+      return i;
+    case 1:
+      return i << 16;
+    default:
+      /* thread t owns t, t + 32, ..., and keys are 8 apart */
+      return ((i % 32) * element_num + i / 32) * 8;
+  }
+}
+
+void test_hash_distribution() {
+  ulint n = (ulint)thread_num * element_num;
+  ulint size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  uint32 *chains = static_cast<uint32 *>(lf_alloc(sizeof(uint32) * size));
+
+  for (uint h = 0; h < array_elements(kv_hashes); h++) {
+    for (int key_set = 0; key_set < 3; key_set++) {
+      memset(chains, 0, sizeof(uint32) * size);
+      for (ulint i = 0; i < n; i++) {
+        ulint key = kv_key_of(key_set, i);
+        ulint hashnr = kv_hashes[h].func((uchar *)&key, sizeof(key));
+        chains[(hashnr & INT_MAX32) % size]++;
+      }
+      uint64 sum_sq = 0;
+      ulint empty = 0;
+      uint32 longest = 0;
+      for (ulint b = 0; b < size; b++) {
+        sum_sq += (uint64)chains[b] * chains[b];
+        empty += !chains[b];
+        longest = lf_max(longest, chains[b]);
+      }
+      printf("%-6s %-12s skew %6.2f, empty buckets %5.1f%%, "
+             "longest chain %u\n",
+             kv_hashes[h].name, kv_key_set_names[key_set],
+             (double)sum_sq / n / (1.0 + (double)(n - 1) / size),
+             100.0 * empty / size, longest);
+    }
+
+    ulint sum = 0;
+    uint64_t st = NowMicros();
+    for (ulint i = 0; i < n; i++) {
+      sum += kv_hashes[h].func((uchar *)&i, sizeof(i));
+    }
+    uint64_t ed = NowMicros();
+    printf("%-6s hash %lu keys, time cost %llu us (%.2f ns/key, sum %lu)\n",
+           kv_hashes[h].name, n, (unsigned long long)(ed - st),
+           1000.0 * (ed - st) / n, sum);
+  }
+  lf_free(chains);
+}
 
+static void usage() {
+  fprintf(stderr, "lf_hash\n");
+  fprintf(stderr, "  -t thread_num\n");
+  fprintf(stderr, "  -e element_num\n");
+  fprintf(stderr, "  -b run the false sharing benchmark\n");
+  fprintf(stderr, "  -s run the string key benchmark\n");
+  fprintf(stderr, "  -i initialize new buckets eagerly on insert\n");
+  fprintf(stderr, "  -f run the bloom filter benchmark\n");
+  fprintf(stderr, "  -r run the ordered index (skiplist) benchmark\n");
+  fprintf(stderr, "  -H xor|murmur|wy|crc32 hash function of the key_value "
+                  "tests\n");
+  fprintf(stderr, "  -d run the hash distribution diagnostic\n");
+  fprintf(stderr, "  -g run the background reclaimer test\n");
+  fprintf(stderr, "  -n run the intrusive hash test\n");
+  fprintf(stderr, "  -p run the fixed capacity test\n");
+  fprintf(stderr, "  -m run the snapshot (LF_HASH_MVCC) test\n");
+  fprintf(stderr, "  -x run the batch delete benchmark\n");
 }
 
+int main(int argc, char *argv[]){
+  int c;
+  bool false_sharing = false;
+  bool str_keys = false;
+  bool bloom = false;
+  bool ordered_index = false;
+  bool distribution = false;
+  bool reclaimer = false;
+  bool intrusive = false;
+  bool fixed_capacity = false;
+  bool snapshot = false;
+  bool batch_delete = false;
+
+  while (-1 != (c = getopt(argc, argv, "ht:e:bsifrH:dgnpmx"))) {
+    switch (c) {
+      case 't':
+        thread_num = atoi(optarg);
+        break;
+      case 'e':
+        element_num = atoi(optarg);
+        break;
+      case 'b':
+        false_sharing = true;
+        break;
+      case 's':
+        str_keys = true;
+        break;
+      case 'i':
+        hash_flags |= LF_HASH_EAGER_BUCKETS;
+        break;
+      case 'f':
+        bloom = true;
+        break;
+      case 'r':
+        ordered_index = true;
+        break;
+      case 'H':
+        kv_hash = NULL;
+        for (uint h = 0; h < array_elements(kv_hashes); h++) {
+          if (!strcmp(optarg, kv_hashes[h].name)) {
+            kv_hash = kv_hashes[h].func;
+          }
+        }
+        if (!kv_hash) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'd':
+        distribution = true;
+        break;
+      case 'g':
+        reclaimer = true;
+        break;
+      case 'n':
+        intrusive = true;
+        break;
+      case 'p':
+        fixed_capacity = true;
+        break;
+      case 'm':
+        snapshot = true;
+        break;
+      case 'x':
+        batch_delete = true;
+        break;
+      case 'h':
+      default:
+        usage();
+        return 0;
+    }
+  }
+
+  if (false_sharing) {
+    test_lf_hash_false_sharing(0);
+    test_lf_hash_false_sharing(LF_HASH_ALIGN_NODES);
+    return 0;
+  }
+
+  if (reclaimer) {
+    test_lf_hash_reclaimer(false);
+    test_lf_hash_reclaimer(true);
+    return 0;
+  }
+
+  if (intrusive) {
+    test_lf_hash_intrusive();
+    return 0;
+  }
+
+  if (fixed_capacity) {
+    test_lf_hash_fixed_capacity(false);
+    test_lf_hash_fixed_capacity(true);
+    return 0;
+  }
+
+  if (snapshot) {
+    test_lf_hash_snapshot();
+    return 0;
+  }
+
+  if (str_keys) {
+    test_lf_hash_str_keys(0);
+    test_lf_hash_str_keys(LF_HASH_INLINE_KEYS);
+    return 0;
+  }
+
+  if (bloom) {
+    test_lf_hash_bloom(false);
+    test_lf_hash_bloom(true);
+    return 0;
+  }
+
+  if (distribution) {
+    test_hash_distribution();
+    return 0;
+  }
+
+  if (batch_delete) {
+    test_lf_hash_delete_batch(1);
+    test_lf_hash_delete_batch(LF_PURGATORY_SIZE);
+    test_lf_hash_delete_batch(4 * LF_PURGATORY_SIZE);
+    return 0;
+  }
+
+  if (ordered_index) {
+    test_ordered_index(true);
+    test_ordered_index(false);
+    return 0;
+  }
 
-int main(){
   // test_lf_hash();
   test_lf_hash_mutilthreads();
     
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+
+#include "fast_hash.hpp"
+#include "flat_hash_map.hpp"
+
+namespace ska
+{
+
+// a test-and-test-and-set lock, for submaps that are held for a few
+// hundred cycles at most
+struct spin_lock
+{
+    void lock()
+    {
+        while (locked.exchange(true, std::memory_order_acquire))
+        {
+            while (locked.load(std::memory_order_relaxed))
+                sched_yield();
+        }
+    }
+    bool try_lock()
+    {
+        return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire);
+    }
+    void unlock()
+    {
+        locked.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> locked{false};
+};
+
+// no locking at all, for a parallel_flat_hash_map that is only used by
+// one thread at a time
+struct null_mutex
+{
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+};
+
+// A flat_hash_map split into 2^SubmapBits submaps, each one a
+// sherwood_v3_table with its own lock, so that threads working on
+// different submaps never wait for each other. The submap is picked by the
+// high bits of the remixed hash, they are independent of the bits that
+// the hash policy of the submap uses for the slot.
+//
+// Entries can't be handed out by reference or iterator, another thread
+// may rehash the submap as soon as its lock is released. So lookups copy
+// the value out and updates go through callbacks that run under the lock.
+// Mutex is anything with lock() and unlock(): std::mutex, ska::spin_lock,
+// ska::null_mutex...
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> >, size_t SubmapBits = 4, typename Mutex = std::mutex>
+class parallel_flat_hash_map
+{
+    static_assert(SubmapBits > 0 && SubmapBits < 16, "2 to 32768 submaps");
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using Map = flat_hash_map<K, V, H, E, A>;
+
+    static constexpr size_t num_submaps = size_t(1) << SubmapBits;
+
+    parallel_flat_hash_map()
+    {
+    }
+
+    // inserts if the key is not there, returns whether it did
+    template<typename... Args>
+    bool emplace(const K & key, Args &&... args)
+    {
+        Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        return submap.map.emplace(key, std::forward<Args>(args)...).second;
+    }
+    bool insert(const std::pair<K, V> & value)
+    {
+        return emplace(value.first, value.second);
+    }
+    // returns true if inserted, false if an existing value was assigned
+    template<typename M>
+    bool insert_or_assign(const K & key, M && m)
+    {
+        Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        return submap.map.insert_or_assign(key, std::forward<M>(m)).second;
+    }
+
+    // copies the value of the key to 'value', returns false if not found
+    bool find(const K & key, V & value) const
+    {
+        const Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        auto found = submap.map.find(key);
+        if (found == submap.map.end())
+            return false;
+        value = found->second;
+        return true;
+    }
+    size_t count(const K & key) const
+    {
+        const Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        return submap.map.count(key);
+    }
+
+    // calls f(value) under the lock of the submap if the key is there
+    template<typename F>
+    bool modify_if(const K & key, F && f)
+    {
+        Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        auto found = submap.map.find(key);
+        if (found == submap.map.end())
+            return false;
+        f(found->second);
+        return true;
+    }
+    // calls f(value) on the existing value, or inserts V(args...)
+    // returns true if inserted
+    template<typename F, typename... Args>
+    bool try_emplace_l(const K & key, F && f, Args &&... args)
+    {
+        Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        auto emplaced = submap.map.emplace(key, std::forward<Args>(args)...);
+        if (!emplaced.second)
+            f(emplaced.first->second);
+        return emplaced.second;
+    }
+
+    size_t erase(const K & key)
+    {
+        Submap & submap = submap_for(key);
+        std::lock_guard<Mutex> guard(submap.mutex);
+        return submap.map.erase(key);
+    }
+
+    // calls f(const K &, V &) for every entry, one submap at a time: it
+    // sees each submap consistently, not the whole map
+    template<typename F>
+    void for_each(F && f)
+    {
+        for (Submap & submap : submaps)
+        {
+            std::lock_guard<Mutex> guard(submap.mutex);
+            for (auto & entry : submap.map)
+                f(entry.first, entry.second);
+        }
+    }
+
+    // not exact while other threads insert or erase
+    size_t size() const
+    {
+        size_t result = 0;
+        for (const Submap & submap : submaps)
+        {
+            std::lock_guard<Mutex> guard(submap.mutex);
+            result += submap.map.size();
+        }
+        return result;
+    }
+    bool empty() const
+    {
+        return size() == 0;
+    }
+    void clear()
+    {
+        for (Submap & submap : submaps)
+        {
+            std::lock_guard<Mutex> guard(submap.mutex);
+            submap.map.clear();
+        }
+    }
+    // room for num_elements in total, spread evenly over the submaps
+    void reserve(size_t num_elements)
+    {
+        for (Submap & submap : submaps)
+        {
+            std::lock_guard<Mutex> guard(submap.mutex);
+            submap.map.reserve(num_elements / num_submaps + 1);
+        }
+    }
+
+    size_t submap_index(const K & key) const
+    {
+        return murmur_mix(hasher(key)) >> (64 - SubmapBits);
+    }
+
+private:
+    // one per cache line, so that taking one lock doesn't slow down the
+    // threads that work on the neighbours
+    struct alignas(64) Submap
+    {
+        mutable Mutex mutex;
+        Map map;
+    };
+
+    Submap & submap_for(const K & key)
+    {
+        return submaps[submap_index(key)];
+    }
+    const Submap & submap_for(const K & key) const
+    {
+        return submaps[submap_index(key)];
+    }
+
+    H hasher;
+    Submap submaps[num_submaps];
+};
+
+} // end namespace ska
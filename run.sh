@@ -2,6 +2,21 @@
 
 g++ stl_hash.cc -lpthread -std=c++11 -O2 -o stl_hash
 g++ ska_hash.cc -lpthread -std=c++11 -O2 -o ska_hash
+g++ atomic_hash.cc -lpthread -std=c++11 -O2 -o atomic_hash
+
+echo "ska hash string keys by const char *"
+./ska_hash -k -e 1000000
+echo "ska hash lookups in batches, plain find / find_batch"
+./ska_hash -b plain -e 10000000
+./ska_hash -b prefetch -e 10000000
+echo "ska hash erase 10% to 90%, by iterator / erase_if"
+./ska_hash -d -e 10000000
+echo "ska hash interleaved / soa layout, hits and misses"
+./ska_hash -o -e 100000
+./ska_hash -o -e 1000000
+./ska_hash -o -e 4000000
+echo "ska hash uint64 keys after reserve, on 4K pages / on huge pages"
+./ska_hash -u -e 10000000
 
 for nthr in 1 2 4 8 16 32; do
 # for nthr in 32; do
@@ -9,5 +24,22 @@ for nthr in 1 2 4 8 16 32; do
   ./stl_hash -t $nthr -e 1000000
   echo "ska hash thread num $nthr"
   ./ska_hash -t $nthr -e 1000000
+  echo "ska parallel hash thread num $nthr"
+  ./ska_hash -p -t $nthr -e 1000000
+  echo "ska parallel spin hash thread num $nthr"
+  ./ska_hash -s -t $nthr -e 1000000
+  echo "ska snapshot hash thread num $nthr"
+  ./ska_hash -r -t $nthr -e 1000000
+  echo "ska simd hash thread num $nthr"
+  ./ska_hash -g -t $nthr -e 1000000
+  echo "ska hash / ska simd hash, missing keys, thread num $nthr"
+  ./ska_hash -m -t $nthr -e 1000000
+  ./ska_hash -g -m -t $nthr -e 1000000
+  ./ska_hash -a -m -t $nthr -e 1000000
+  echo "ska hash / ska incremental hash, slowest insert, thread num $nthr"
+  ./ska_hash -l -t $nthr -e 1000000
+  ./ska_hash -i -l -t $nthr -e 1000000
+  echo "atomic hash thread num $nthr"
+  ./atomic_hash -t $nthr -e 1000000
 done
 
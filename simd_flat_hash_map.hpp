@@ -0,0 +1,775 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <tuple>
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <iterator>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fast_hash.hpp"
+
+namespace ska
+{
+
+namespace detailsimd
+{
+
+// control byte of a slot: a full slot holds the low 7 bits of its hash,
+// the two other states have the high bit set
+static constexpr int8_t ctrl_empty = -128; // 0b10000000
+static constexpr int8_t ctrl_deleted = -2; // 0b11111110
+
+// a set of slots of a group, one bit (or one byte for the portable group)
+// per slot
+template<typename T, int Shift>
+struct BitMask
+{
+    T mask;
+
+    explicit operator bool() const
+    {
+        return mask != 0;
+    }
+    int lowest() const
+    {
+        return __builtin_ctzll(mask) >> Shift;
+    }
+    BitMask & operator++()
+    {
+        mask &= mask - 1;
+        return *this;
+    }
+};
+
+#if defined(__AVX2__)
+// 32 control bytes matched at once
+struct Group
+{
+    static constexpr size_t width = 32;
+    typedef BitMask<uint32_t, 0> Mask;
+
+    // operator new only guarantees 16 byte alignment before C++17
+    explicit Group(const int8_t * pos)
+        : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos)))
+    {
+    }
+    Mask match(int8_t h2) const
+    {
+        return Mask{static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl)))};
+    }
+    Mask match_empty() const
+    {
+        return match(ctrl_empty);
+    }
+    // empty and deleted are the only states with the high bit set
+    Mask match_empty_or_deleted() const
+    {
+        return Mask{static_cast<uint32_t>(_mm256_movemask_epi8(ctrl))};
+    }
+
+    __m256i ctrl;
+};
+#elif defined(__SSE2__)
+// 16 control bytes matched at once
+struct Group
+{
+    static constexpr size_t width = 16;
+    typedef BitMask<uint32_t, 0> Mask;
+
+    explicit Group(const int8_t * pos)
+        : ctrl(_mm_load_si128(reinterpret_cast<const __m128i *>(pos)))
+    {
+    }
+    Mask match(int8_t h2) const
+    {
+        return Mask{static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)))};
+    }
+    Mask match_empty() const
+    {
+        return match(ctrl_empty);
+    }
+    Mask match_empty_or_deleted() const
+    {
+        return Mask{static_cast<uint32_t>(_mm_movemask_epi8(ctrl))};
+    }
+
+    __m128i ctrl;
+};
+#else
+// 8 control bytes in a word, matched with bit tricks. match() may report a
+// false positive right after a true one, the key compare filters it out
+struct Group
+{
+    static constexpr size_t width = 8;
+    typedef BitMask<uint64_t, 3> Mask;
+    static constexpr uint64_t lsbs = 0x0101010101010101ull;
+    static constexpr uint64_t msbs = 0x8080808080808080ull;
+
+    explicit Group(const int8_t * pos)
+    {
+        std::memcpy(&ctrl, pos, sizeof(ctrl));
+    }
+    Mask match(int8_t h2) const
+    {
+        uint64_t x = ctrl ^ (lsbs * static_cast<uint8_t>(h2));
+        return Mask{(x - lsbs) & ~x & msbs};
+    }
+    // empty is the only state with the high bit set and bit 1 clear
+    Mask match_empty() const
+    {
+        return Mask{ctrl & ~(ctrl << 6) & msbs};
+    }
+    Mask match_empty_or_deleted() const
+    {
+        return Mask{ctrl & msbs};
+    }
+
+    uint64_t ctrl;
+};
+#endif
+
+} // end namespace detailsimd
+
+// A hash map with the API of ska::flat_hash_map that keeps a separate array
+// of one control byte per slot: the 7 low bits of the hash of a full slot,
+// or empty or deleted. A lookup loads a group of 16 control bytes (32 with
+// AVX2, 8 in a word without SSE2) and compares all of them with the hash
+// bits at once, so it touches the slots only for the few candidates whose
+// 7 bits match; a miss usually ends at the first group because it has an
+// empty slot. Groups are probed quadratically, a group at a time.
+//
+// The hash is remixed before use, identity hashes like std::hash<int> are
+// fine. The maximum load factor is fixed at 7/8. An erased slot becomes
+// empty again if its group has an empty slot (no probe went past that
+// group), a tombstone otherwise; tombstones are dropped by the next rehash.
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> > >
+class simd_flat_hash_map : private H, private E
+{
+    using Group = detailsimd::Group;
+    using AllocTraits = std::allocator_traits<A>;
+    using CtrlAlloc = typename AllocTraits::template rebind_alloc<Group>;
+    using CtrlAllocTraits = std::allocator_traits<CtrlAlloc>;
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<K, V>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using hasher = H;
+    using key_equal = E;
+    using allocator_type = A;
+    using reference = value_type &;
+    using const_reference = const value_type &;
+    using pointer = value_type *;
+    using const_pointer = const value_type *;
+
+    template<typename ValueType>
+    struct templated_iterator
+    {
+        templated_iterator() = default;
+        templated_iterator(const int8_t * ctrl, value_type * slot)
+            : ctrl(ctrl), slot(slot)
+        {
+        }
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = ValueType;
+        using difference_type = std::ptrdiff_t;
+        using pointer = ValueType *;
+        using reference = ValueType &;
+
+        friend bool operator==(const templated_iterator & lhs, const templated_iterator & rhs)
+        {
+            return lhs.slot == rhs.slot;
+        }
+        friend bool operator!=(const templated_iterator & lhs, const templated_iterator & rhs)
+        {
+            return !(lhs == rhs);
+        }
+
+        templated_iterator & operator++()
+        {
+            do
+            {
+                ++ctrl;
+                ++slot;
+            }
+            while (*ctrl < 0 && *ctrl != sentinel);
+            return *this;
+        }
+        templated_iterator operator++(int)
+        {
+            templated_iterator copy(*this);
+            ++*this;
+            return copy;
+        }
+
+        ValueType & operator*() const
+        {
+            return *slot;
+        }
+        ValueType * operator->() const
+        {
+            return slot;
+        }
+
+        operator templated_iterator<const ValueType>() const
+        {
+            return { ctrl, slot };
+        }
+
+        const int8_t * ctrl = nullptr;
+        value_type * slot = nullptr;
+    };
+    using iterator = templated_iterator<value_type>;
+    using const_iterator = templated_iterator<const value_type>;
+
+    simd_flat_hash_map()
+    {
+    }
+    explicit simd_flat_hash_map(size_type bucket_count, const H & hash = H(), const E & equal = E(), const A & alloc = A())
+        : H(hash), E(equal), slot_alloc(alloc)
+    {
+        rehash(bucket_count);
+    }
+    simd_flat_hash_map(std::initializer_list<value_type> il)
+    {
+        reserve(il.size());
+        insert(il.begin(), il.end());
+    }
+    simd_flat_hash_map(const simd_flat_hash_map & other)
+        : H(other), E(other), slot_alloc(AllocTraits::select_on_container_copy_construction(other.slot_alloc))
+    {
+        reserve(other.size());
+        insert(other.begin(), other.end());
+    }
+    simd_flat_hash_map(simd_flat_hash_map && other) noexcept
+        : H(std::move(other)), E(std::move(other)), slot_alloc(std::move(other.slot_alloc))
+    {
+        swap_storage(other);
+    }
+    simd_flat_hash_map & operator=(const simd_flat_hash_map & other)
+    {
+        if (this == std::addressof(other))
+            return *this;
+        clear();
+        static_cast<H &>(*this) = other;
+        static_cast<E &>(*this) = other;
+        reserve(other.size());
+        insert(other.begin(), other.end());
+        return *this;
+    }
+    simd_flat_hash_map & operator=(simd_flat_hash_map && other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+    ~simd_flat_hash_map()
+    {
+        destroy_slots();
+        deallocate();
+    }
+
+    iterator begin()
+    {
+        return first_full<iterator>();
+    }
+    const_iterator begin() const
+    {
+        return first_full<const_iterator>();
+    }
+    const_iterator cbegin() const
+    {
+        return begin();
+    }
+    iterator end()
+    {
+        return { ctrl + num_slots, slots + num_slots };
+    }
+    const_iterator end() const
+    {
+        return { ctrl + num_slots, slots + num_slots };
+    }
+    const_iterator cend() const
+    {
+        return end();
+    }
+
+    iterator find(const K & key)
+    {
+        size_t index = find_index(key);
+        if (index == npos)
+            return end();
+        return { ctrl + index, slots + index };
+    }
+    const_iterator find(const K & key) const
+    {
+        return const_cast<simd_flat_hash_map *>(this)->find(key);
+    }
+    size_t count(const K & key) const
+    {
+        return find_index(key) == npos ? 0 : 1;
+    }
+    std::pair<iterator, iterator> equal_range(const K & key)
+    {
+        iterator found = find(key);
+        if (found == end())
+            return { found, found };
+        return { found, std::next(found) };
+    }
+
+    V & operator[](const K & key)
+    {
+        return emplace_key(key).first->second;
+    }
+    V & operator[](K && key)
+    {
+        return emplace_key(std::move(key)).first->second;
+    }
+    V & at(const K & key)
+    {
+        iterator found = find(key);
+        if (found == end())
+            throw std::out_of_range("Argument passed to at() was not in the map.");
+        return found->second;
+    }
+    const V & at(const K & key) const
+    {
+        return const_cast<simd_flat_hash_map *>(this)->at(key);
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args &&... args)
+    {
+        // the key is needed before there's a slot to construct into
+        value_type value(std::forward<Args>(args)...);
+        return emplace_value(std::move(value));
+    }
+    template<typename... Args>
+    iterator emplace_hint(const_iterator, Args &&... args)
+    {
+        return emplace(std::forward<Args>(args)...).first;
+    }
+    std::pair<iterator, bool> insert(const value_type & value)
+    {
+        return emplace_value(value);
+    }
+    std::pair<iterator, bool> insert(value_type && value)
+    {
+        return emplace_value(std::move(value));
+    }
+    iterator insert(const_iterator, const value_type & value)
+    {
+        return insert(value).first;
+    }
+    template<typename It>
+    void insert(It begin, It end)
+    {
+        for (; begin != end; ++begin)
+            emplace(*begin);
+    }
+    void insert(std::initializer_list<value_type> il)
+    {
+        insert(il.begin(), il.end());
+    }
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const K & key, M && m)
+    {
+        std::pair<iterator, bool> emplace_result = emplace_key(key);
+        emplace_result.first->second = std::forward<M>(m);
+        return emplace_result;
+    }
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(K && key, M && m)
+    {
+        std::pair<iterator, bool> emplace_result = emplace_key(std::move(key));
+        emplace_result.first->second = std::forward<M>(m);
+        return emplace_result;
+    }
+
+    iterator erase(const_iterator to_erase)
+    {
+        size_t index = to_erase.slot - slots;
+        erase_index(index);
+        iterator next = { ctrl + index, slots + index };
+        if (*next.ctrl < 0)
+            ++next;
+        return next;
+    }
+    iterator erase(iterator to_erase)
+    {
+        return erase(const_iterator(to_erase));
+    }
+    iterator erase(const_iterator begin_it, const_iterator end_it)
+    {
+        while (begin_it != end_it)
+            begin_it = erase(begin_it);
+        return { const_cast<int8_t *>(end_it.ctrl), end_it.slot };
+    }
+    size_t erase(const K & key)
+    {
+        size_t index = find_index(key);
+        if (index == npos)
+            return 0;
+        erase_index(index);
+        return 1;
+    }
+
+    void clear()
+    {
+        destroy_slots();
+        if (num_slots)
+            reset_ctrl();
+        num_elements = 0;
+    }
+    void shrink_to_fit()
+    {
+        rehash(num_elements);
+    }
+    void reserve(size_t count)
+    {
+        // growth_left is kept for the 7/8 load factor
+        rehash(count + count / 7);
+    }
+    // makes room for at least num_buckets slots, or fewer if that's still
+    // more than enough for the elements
+    void rehash(size_t num_buckets)
+    {
+        if (num_elements)
+            num_buckets = std::max(num_buckets, num_elements + num_elements / 7 + 1);
+        size_t new_num_slots = 0;
+        if (num_buckets)
+        {
+            new_num_slots = Group::width;
+            while (new_num_slots < num_buckets)
+                new_num_slots *= 2;
+        }
+        if (new_num_slots == num_slots && growth_left + num_elements == max_elements(num_slots))
+            return;
+        resize(new_num_slots);
+    }
+
+    void swap(simd_flat_hash_map & other)
+    {
+        using std::swap;
+        swap(static_cast<H &>(*this), static_cast<H &>(other));
+        swap(static_cast<E &>(*this), static_cast<E &>(other));
+        if (AllocTraits::propagate_on_container_swap::value)
+            swap(slot_alloc, other.slot_alloc);
+        swap_storage(other);
+    }
+
+    size_t size() const
+    {
+        return num_elements;
+    }
+    size_t max_size() const
+    {
+        return AllocTraits::max_size(slot_alloc);
+    }
+    bool empty() const
+    {
+        return num_elements == 0;
+    }
+    size_t bucket_count() const
+    {
+        return num_slots;
+    }
+    size_t max_bucket_count() const
+    {
+        return max_size();
+    }
+    float load_factor() const
+    {
+        return num_slots ? static_cast<float>(num_elements) / num_slots : 0.0f;
+    }
+    float max_load_factor() const
+    {
+        return 7.0f / 8.0f;
+    }
+    // the load factor is fixed, it's what the control bytes are sized for
+    void max_load_factor(float)
+    {
+    }
+
+    hasher hash_function() const
+    {
+        return static_cast<const H &>(*this);
+    }
+    key_equal key_eq() const
+    {
+        return static_cast<const E &>(*this);
+    }
+    allocator_type get_allocator() const
+    {
+        return slot_alloc;
+    }
+
+    friend bool operator==(const simd_flat_hash_map & lhs, const simd_flat_hash_map & rhs)
+    {
+        if (lhs.size() != rhs.size())
+            return false;
+        for (const value_type & value : lhs)
+        {
+            auto found = rhs.find(value.first);
+            if (found == rhs.end())
+                return false;
+            else if (value.second != found->second)
+                return false;
+        }
+        return true;
+    }
+    friend bool operator!=(const simd_flat_hash_map & lhs, const simd_flat_hash_map & rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+private:
+    static constexpr size_t npos = size_t(-1);
+    // the iterator stops here, past the last control byte
+    static constexpr int8_t sentinel = -1;
+
+    // ctrl is num_slots bytes in whole groups, plus one group of end
+    // sentinels; slots is num_slots values. The empty map has no storage,
+    // just a static sentinel byte.
+    int8_t * ctrl = empty_group();
+    value_type * slots = nullptr;
+    size_t num_slots = 0;
+    size_t num_elements = 0;
+    size_t growth_left = 0;
+    A slot_alloc;
+
+    static int8_t * empty_group()
+    {
+        // begin() == end() on an empty map
+        static int8_t end_byte = sentinel;
+        return &end_byte;
+    }
+
+    static size_t max_elements(size_t slot_count)
+    {
+        return slot_count - slot_count / 8;
+    }
+
+    // the control byte comes from the low 7 bits of the mixed hash and
+    // the first group from the bits above them
+    size_t hash_of(const K & key) const
+    {
+        return murmur_mix(static_cast<const H &>(*this)(key));
+    }
+    static int8_t h2(size_t hash)
+    {
+        return static_cast<int8_t>(hash & 0x7f);
+    }
+    size_t first_group(size_t hash) const
+    {
+        return (hash >> 7) & (num_slots / Group::width - 1);
+    }
+    bool compares_equal(const K & lhs, const K & rhs) const
+    {
+        return static_cast<const E &>(*this)(lhs, rhs);
+    }
+
+    template<typename It>
+    It first_full() const
+    {
+        It it = { ctrl, slots };
+        if (*it.ctrl < 0 && *it.ctrl != sentinel)
+            ++it;
+        return it;
+    }
+
+    size_t find_index(const K & key) const
+    {
+        if (!num_slots)
+            return npos;
+        size_t hash = hash_of(key);
+        size_t group_mask = num_slots / Group::width - 1;
+        size_t group = first_group(hash);
+        for (size_t probe = 1;; ++probe)
+        {
+            Group g(ctrl + group * Group::width);
+            for (typename Group::Mask match = g.match(h2(hash)); match; ++match)
+            {
+                size_t index = group * Group::width + match.lowest();
+                if (compares_equal(key, slots[index].first))
+                    return index;
+            }
+            if (g.match_empty())
+                return npos;
+            // triangular numbers visit every group of a power of two
+            group = (group + probe) & group_mask;
+        }
+    }
+
+    // the first empty or deleted slot of the probe sequence of 'hash'
+    size_t find_free(size_t hash) const
+    {
+        size_t group_mask = num_slots / Group::width - 1;
+        size_t group = first_group(hash);
+        for (size_t probe = 1;; ++probe)
+        {
+            typename Group::Mask free = Group(ctrl + group * Group::width).match_empty_or_deleted();
+            if (free)
+                return group * Group::width + free.lowest();
+            group = (group + probe) & group_mask;
+        }
+    }
+
+    template<typename Key>
+    std::pair<iterator, bool> emplace_key(Key && key)
+    {
+        size_t index = find_index(key);
+        if (index != npos)
+            return { { ctrl + index, slots + index }, false };
+        return emplace_new(hash_of(key), std::piecewise_construct, std::forward_as_tuple(std::forward<Key>(key)), std::forward_as_tuple());
+    }
+    template<typename Value>
+    std::pair<iterator, bool> emplace_value(Value && value)
+    {
+        size_t index = find_index(value.first);
+        if (index != npos)
+            return { { ctrl + index, slots + index }, false };
+        return emplace_new(hash_of(value.first), std::forward<Value>(value));
+    }
+    template<typename... Args>
+    std::pair<iterator, bool> emplace_new(size_t hash, Args &&... args)
+    {
+        if (!num_slots)
+            grow();
+        size_t index = find_free(hash);
+        // reusing a tombstone doesn't take any room
+        if (growth_left == 0 && ctrl[index] != detailsimd::ctrl_deleted)
+        {
+            grow();
+            index = find_free(hash);
+        }
+        AllocTraits::construct(slot_alloc, slots + index, std::forward<Args>(args)...);
+        if (ctrl[index] == detailsimd::ctrl_empty)
+            --growth_left;
+        ctrl[index] = h2(hash);
+        ++num_elements;
+        return { { ctrl + index, slots + index }, true };
+    }
+
+    void erase_index(size_t index)
+    {
+        AllocTraits::destroy(slot_alloc, slots + index);
+        --num_elements;
+        size_t group = index / Group::width * Group::width;
+        if (Group(ctrl + group).match_empty())
+        {
+            ctrl[index] = detailsimd::ctrl_empty;
+            ++growth_left;
+        }
+        else
+            ctrl[index] = detailsimd::ctrl_deleted;
+    }
+
+    // doubles, unless dropping the tombstones frees enough slots
+    void grow()
+    {
+        if (num_slots && num_elements < max_elements(num_slots) / 2)
+            resize(num_slots);
+        else
+            resize(num_slots ? num_slots * 2 : Group::width);
+    }
+
+    void reset_ctrl()
+    {
+        std::memset(ctrl, detailsimd::ctrl_empty, num_slots);
+        std::memset(ctrl + num_slots, sentinel, Group::width);
+        growth_left = max_elements(num_slots);
+    }
+
+    void resize(size_t new_num_slots)
+    {
+        int8_t * old_ctrl = ctrl;
+        value_type * old_slots = slots;
+        size_t old_num_slots = num_slots;
+
+        if (new_num_slots)
+        {
+            CtrlAlloc ctrl_alloc(slot_alloc);
+            Group * groups = CtrlAllocTraits::allocate(ctrl_alloc, new_num_slots / Group::width + 1);
+            try
+            {
+                slots = AllocTraits::allocate(slot_alloc, new_num_slots);
+            }
+            catch (...)
+            {
+                CtrlAllocTraits::deallocate(ctrl_alloc, groups, new_num_slots / Group::width + 1);
+                throw;
+            }
+            ctrl = reinterpret_cast<int8_t *>(groups);
+        }
+        else
+        {
+            ctrl = empty_group();
+            slots = nullptr;
+        }
+        num_slots = new_num_slots;
+        if (num_slots)
+            reset_ctrl();
+        else
+            growth_left = 0;
+
+        for (size_t i = 0; i < old_num_slots; ++i)
+        {
+            if (old_ctrl[i] < 0)
+                continue;
+            size_t hash = hash_of(old_slots[i].first);
+            size_t index = find_free(hash);
+            AllocTraits::construct(slot_alloc, slots + index, std::move(old_slots[i]));
+            AllocTraits::destroy(slot_alloc, old_slots + i);
+            ctrl[index] = h2(hash);
+            --growth_left;
+        }
+        deallocate(old_ctrl, old_slots, old_num_slots);
+    }
+
+    void destroy_slots()
+    {
+        for (size_t i = 0; i < num_slots; ++i)
+        {
+            if (ctrl[i] >= 0)
+                AllocTraits::destroy(slot_alloc, slots + i);
+        }
+    }
+    void deallocate(int8_t * old_ctrl, value_type * old_slots, size_t old_num_slots)
+    {
+        if (!old_num_slots)
+            return;
+        CtrlAlloc ctrl_alloc(slot_alloc);
+        CtrlAllocTraits::deallocate(ctrl_alloc, reinterpret_cast<Group *>(old_ctrl), old_num_slots / Group::width + 1);
+        AllocTraits::deallocate(slot_alloc, old_slots, old_num_slots);
+    }
+    void deallocate()
+    {
+        deallocate(ctrl, slots, num_slots);
+    }
+
+    void swap_storage(simd_flat_hash_map & other)
+    {
+        using std::swap;
+        swap(ctrl, other.ctrl);
+        swap(slots, other.slots);
+        swap(num_slots, other.num_slots);
+        swap(num_elements, other.num_elements);
+        swap(growth_left, other.growth_left);
+    }
+};
+
+} // end namespace ska
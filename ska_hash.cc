@@ -1,3 +1,4 @@
+#include <atomic>
 #include <iostream>
 #include <map>
 #include <stdio.h>
@@ -6,11 +7,21 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <random>
 #include <assert.h>
 #include <string.h>
+#include <string>
+#include <new>
 
+#include "fast_hash.hpp"
 #include "flat_hash_map.hpp"
+#include "parallel_flat_hash_map.hpp"
+#include "simd_flat_hash_map.hpp"
+#include "soa_flat_hash_map.hpp"
+#include "incremental_flat_hash_map.hpp"
+#include "huge_page_allocator.hpp"
+#include "snapshot_flat_hash_map.hpp"
 
 uint64_t NowMicros() {
   struct timeval tv;
@@ -19,9 +30,61 @@ uint64_t NowMicros() {
 }
 
 ska::flat_hash_map<int, int> m_hash;
+ska::simd_flat_hash_map<int, int> m_simd_hash;
+ska::soa_flat_hash_map<int, int> m_soa_hash;
+ska::incremental_flat_hash_map<int, int> m_incremental_hash;
+// filled through m_hash under the global mutex, then published in one go
+ska::snapshot_flat_hash_map<int, int> m_snapshot_hash;
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+// 64 submaps, each with its own std::mutex or spin lock
+typedef ska::parallel_flat_hash_map<int, int, std::hash<int>, std::equal_to<int>,
+                                    std::allocator<std::pair<int, int> >, 6>
+    mutex_parallel_map;
+typedef ska::parallel_flat_hash_map<int, int, std::hash<int>, std::equal_to<int>,
+                                    std::allocator<std::pair<int, int> >, 6,
+                                    ska::spin_lock>
+    spin_parallel_map;
+
+mutex_parallel_map m_mutex_phash;
+spin_parallel_map m_spin_phash;
+
+enum map_type { GLOBAL_MUTEX, PARALLEL_MUTEX, PARALLEL_SPIN, SIMD_GLOBAL_MUTEX,
+               SOA_GLOBAL_MUTEX, INCREMENTAL_GLOBAL_MUTEX, SNAPSHOT };
+map_type m_map_type = GLOBAL_MUTEX;
+static const char *map_type_names[] = {"global mutex", "parallel std::mutex",
+                                       "parallel spin lock",
+                                       "simd global mutex",
+                                       "soa global mutex",
+                                       "incremental global mutex",
+                                       "snapshot, lock-free lookups"};
+
+// look up keys that were never inserted, every lookup misses
+bool m_lookup_miss = false;
+
+// time every insert and report the slowest one, that's where the rehash is
+bool m_insert_latency = false;
+std::atomic<uint64_t> m_max_insert_us(0);
+
+bool m_string_keys = false;
+
+bool m_erase_test = false;
+bool m_layout_test = false;
+bool m_huge_page_test = false;
+
+// look up kLookupBatch keys per lock, one find at a time (-b plain) or with
+// find_batch (-b prefetch); global mutex flat_hash_map only
+enum batch_mode { NO_BATCH, BATCH_PLAIN, BATCH_PREFETCH };
+batch_mode m_batch_mode = NO_BATCH;
+const int kLookupBatch = 64;
+std::atomic<uint64_t> m_lookup_sum(0);
+
+// while the snapshot lookups run, publish an updated copy of the table
+// every kSnapshotUpdateMs
+const int kSnapshotUpdateMs = 250;
+std::atomic<bool> m_lookups_done(false);
+
 const int kMaxThreadNum = 128;
 
 pthread_t tid[kMaxThreadNum];
@@ -32,74 +95,527 @@ uint32_t element_num = 10000000;
 
 
 
+template <typename Map, Map *map>
 void *func_insert(void *arg) {
   using namespace std;
 
-  int id = *(int *)&arg;
+  int id = (int)(intptr_t)arg;
+  id *= element_num;
+  for (uint32_t i = 0; i < element_num; i++) {
+    uint64_t st = m_insert_latency ? NowMicros() : 0;
+    pthread_mutex_lock(&::lock);
+    (*map)[i + id] = i + id;
+    pthread_mutex_unlock(&::lock);
+    if (m_insert_latency) {
+      uint64_t cost = NowMicros() - st;
+      uint64_t max = m_max_insert_us.load();
+      while (cost > max && !m_max_insert_us.compare_exchange_weak(max, cost)) {
+      }
+    }
+  }
+  return NULL;
+}
+
+static int lookup_base(int id) {
+  if (m_lookup_miss) {
+    id += thread_num;
+  }
+  return id * element_num;
+}
+
+template <typename Map, Map *map>
+void *func_parallel_insert(void *arg) {
+  int id = (int)(intptr_t)arg;
   id *= element_num;
-  for (int i = 0; i < element_num; i++) {
-    pthread_mutex_lock(&lock);
-    m_hash[i + id] = i + id;
-    pthread_mutex_unlock(&lock);
+  for (uint32_t i = 0; i < element_num; i++) {
+    map->insert_or_assign(i + id, i + id);
+  }
+  return NULL;
+}
+
+template <typename Map, Map *map>
+void *func_parallel_lookup(void *arg) {
+  int id = lookup_base((int)(intptr_t)arg);
+  uint64_t tt = 0;
+  for (uint32_t i = 0; i < element_num; i++) {
+    int value = 0;
+    map->find(i + id, value);
+    tt += value;
+  }
+  m_lookup_sum.fetch_add(tt);
+  return NULL;
+}
+
+template <typename Map, Map *map>
+void *func_lookup(void *arg);
+
+void *func_snapshot_lookup(void *arg) {
+  int id = lookup_base((int)(intptr_t)arg);
+  auto reader = m_snapshot_hash.get_reader();
+  uint64_t tt = 0;
+  for (uint32_t i = 0; i < element_num; i++) {
+    int value = 0;
+    reader.find(i + id, value);
+    tt += value;
+  }
+  m_lookup_sum.fetch_add(tt);
+  return NULL;
+}
+
+// the single writer: copies the current version, changes one key and
+// publishes the copy
+void *func_snapshot_update(void *arg) {
+  uint64_t *updates = (uint64_t *)arg;
+  uint64_t next = NowMicros() + kSnapshotUpdateMs * 1000;
+  while (!m_lookups_done.load()) {
+    usleep(1000);
+    if (NowMicros() < next) {
+      continue;
+    }
+    next += kSnapshotUpdateMs * 1000;
+    m_snapshot_hash.update([updates](ska::flat_hash_map<int, int> &next) {
+      next[0] = (int)*updates;
+    });
+    ++*updates;
+  }
+  m_snapshot_hash.synchronize();
+  return NULL;
+}
+
+void *func_batch_lookup(void *arg) {
+  int id = lookup_base((int)(intptr_t)arg);
+  int keys[kLookupBatch];
+  ska::flat_hash_map<int, int>::iterator found[kLookupBatch];
+  uint64_t tt = 0;
+  for (uint32_t i = 0; i < element_num; i += kLookupBatch) {
+    int n = std::min<int>(kLookupBatch, element_num - i);
+    for (int j = 0; j < n; j++) {
+      keys[j] = i + j + id;
+    }
+    pthread_mutex_lock(&::lock);
+    if (m_batch_mode == BATCH_PREFETCH) {
+      m_hash.find_batch(keys, keys + n, found);
+    } else {
+      for (int j = 0; j < n; j++) {
+        found[j] = m_hash.find(keys[j]);
+      }
+    }
+    for (int j = 0; j < n; j++) {
+      if (found[j] != m_hash.end()) {
+        tt += found[j]->second;
+      }
+    }
+    pthread_mutex_unlock(&::lock);
+  }
+  /* keeps the lookups from being optimized away */
+  m_lookup_sum.fetch_add(tt);
+  return NULL;
+}
+
+typedef void *(*thread_func)(void *);
+
+static thread_func insert_func() {
+  switch (m_map_type) {
+    case PARALLEL_MUTEX:
+      return func_parallel_insert<mutex_parallel_map, &m_mutex_phash>;
+    case PARALLEL_SPIN:
+      return func_parallel_insert<spin_parallel_map, &m_spin_phash>;
+    case SIMD_GLOBAL_MUTEX:
+      return func_insert<ska::simd_flat_hash_map<int, int>, &m_simd_hash>;
+    case SOA_GLOBAL_MUTEX:
+      return func_insert<ska::soa_flat_hash_map<int, int>, &m_soa_hash>;
+    case INCREMENTAL_GLOBAL_MUTEX:
+      return func_insert<ska::incremental_flat_hash_map<int, int>,
+                         &m_incremental_hash>;
+    default:
+      return func_insert<ska::flat_hash_map<int, int>, &m_hash>;
+  }
+}
+
+static thread_func lookup_func() {
+  if (m_batch_mode != NO_BATCH) {
+    return func_batch_lookup;
+  }
+  switch (m_map_type) {
+    case PARALLEL_MUTEX:
+      return func_parallel_lookup<mutex_parallel_map, &m_mutex_phash>;
+    case PARALLEL_SPIN:
+      return func_parallel_lookup<spin_parallel_map, &m_spin_phash>;
+    case SIMD_GLOBAL_MUTEX:
+      return func_lookup<ska::simd_flat_hash_map<int, int>, &m_simd_hash>;
+    case SOA_GLOBAL_MUTEX:
+      return func_lookup<ska::soa_flat_hash_map<int, int>, &m_soa_hash>;
+    case INCREMENTAL_GLOBAL_MUTEX:
+      return func_lookup<ska::incremental_flat_hash_map<int, int>,
+                         &m_incremental_hash>;
+    case SNAPSHOT:
+      return func_snapshot_lookup;
+    default:
+      return func_lookup<ska::flat_hash_map<int, int>, &m_hash>;
   }
 }
 
 void test_hash_insert() {
   m_hash.clear();
+  m_simd_hash.clear();
+  m_soa_hash.clear();
+  m_incremental_hash.clear();
+  m_mutex_phash.clear();
+  m_spin_phash.clear();
 
   uint64_t st, ed;
 
   st = NowMicros();
-  for (int i = 0; i < thread_num; i++) {
-    pthread_create(&tid[i], NULL, func_insert, (void *)i);
+  for (uint32_t i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, insert_func(), (void *)(intptr_t)i);
   }
-  for (int i = 0; i < thread_num; i++) {
+  for (uint32_t i = 0; i < thread_num; i++) {
     pthread_join(tid[i], NULL);
   }
+  if (m_map_type == SNAPSHOT) {
+    m_snapshot_hash.publish(std::move(m_hash));
+  }
   ed = NowMicros();
 
-  printf("insert %lld elements, time cost %lld us\n", (uint64_t)thread_num * (uint64_t)element_num, ed - st);
+  printf("insert %" PRIu64 " elements, time cost %" PRIu64 " us\n", (uint64_t)thread_num * (uint64_t)element_num, ed - st);
+  if (m_insert_latency) {
+    printf("slowest insert %" PRIu64 " us\n", m_max_insert_us.load());
+  }
 }
 
+template <typename Map, Map *map>
 void *func_lookup(void *arg) {
   using namespace std;
 
-  int id = *(int *)&arg;
-  id *= element_num;
-  int tt = 0;
-  for (int i = 0; i < element_num; i++) {
-    pthread_mutex_lock(&lock);
-    tt += m_hash.find(i + id)->second;
-    pthread_mutex_unlock(&lock);
+  int id = lookup_base((int)(intptr_t)arg);
+  uint64_t tt = 0;
+  for (uint32_t i = 0; i < element_num; i++) {
+    pthread_mutex_lock(&::lock);
+    auto it = map->find(i + id);
+    if (it != map->end()) {
+      tt += it->second;
+    }
+    pthread_mutex_unlock(&::lock);
   }
+  m_lookup_sum.fetch_add(tt);
+  return NULL;
 }
 
 void test_hash_lookup() {
 
   uint64_t st, ed;
+  pthread_t writer;
+  uint64_t updates = 0;
 
   st = NowMicros();
-  for (int i = 0; i < thread_num; i++) {
-    pthread_create(&tid[i], NULL, func_lookup, (void *)i);
+  if (m_map_type == SNAPSHOT) {
+    pthread_create(&writer, NULL, func_snapshot_update, &updates);
+  }
+  for (uint32_t i = 0; i < thread_num; i++) {
+    pthread_create(&tid[i], NULL, lookup_func(), (void *)(intptr_t)i);
   }
-  for (int i = 0; i < thread_num; i++) {
+  for (uint32_t i = 0; i < thread_num; i++) {
     pthread_join(tid[i], NULL);
   }
   ed = NowMicros();
+  if (m_map_type == SNAPSHOT) {
+    m_lookups_done.store(true);
+    pthread_join(writer, NULL);
+    printf("%" PRIu64 " snapshots published during the lookups\n", updates);
+  }
 
-  printf("lookup %lld elements, time cost %lld us\n", (uint64_t)thread_num * (uint64_t)element_num, ed - st);
+  printf("lookup %" PRIu64 " %selements%s, time cost %" PRIu64 " us\n", (uint64_t)thread_num * (uint64_t)element_num,
+         m_lookup_miss ? "missing " : "",
+         m_batch_mode == BATCH_PREFETCH ? " by find_batch"
+         : m_batch_mode == BATCH_PLAIN  ? " in batches"
+                                        : "",
+         ed - st);
+}
+
+// allocations made by the string keys and the map of the -k test, it is
+// single threaded
+uint64_t m_allocations = 0;
+
+template <typename T>
+struct counting_allocator {
+  typedef T value_type;
+
+  counting_allocator() {}
+  template <typename U>
+  counting_allocator(const counting_allocator<U> &) {}
+
+  T *allocate(size_t n) {
+    m_allocations++;
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T *ptr, size_t n) { std::allocator<T>().deallocate(ptr, n); }
+
+  template <typename U>
+  bool operator==(const counting_allocator<U> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const counting_allocator<U> &) const {
+    return false;
+  }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, counting_allocator<char> >
+    counted_string;
+
+// hash and compare strings and const char * alike, so that a lookup by a C
+// string doesn't have to build a string
+struct string_hasher {
+  typedef void is_transparent;
+  size_t operator()(const counted_string &key) const {
+    return fast_hash_murmur(reinterpret_cast<const unsigned char *>(key.data()),
+                            key.size());
+  }
+  size_t operator()(const char *key) const {
+    return fast_hash_murmur(reinterpret_cast<const unsigned char *>(key),
+                            strlen(key));
+  }
+};
+
+struct string_equal {
+  typedef void is_transparent;
+  bool operator()(const counted_string &lhs, const counted_string &rhs) const {
+    return lhs == rhs;
+  }
+  bool operator()(const char *lhs, const counted_string &rhs) const {
+    return rhs == lhs;
+  }
+};
+
+// keys longer than the small string buffer, a std::string of one allocates
+static void string_key(char *buf, size_t len, uint32_t i) {
+  snprintf(buf, len, "ska_hash-string-key-%010u", i);
+}
+
+// single threaded: look up string keys that arrive as C strings, once by
+// building a std::string and once through the transparent hasher
+void test_string_lookup() {
+  ska::flat_hash_map<counted_string, int, string_hasher, string_equal,
+                     counting_allocator<std::pair<counted_string, int> > >
+      map;
+  char buf[64];
+
+  for (uint32_t i = 0; i < element_num; i++) {
+    string_key(buf, sizeof(buf), i);
+    map[buf] = i;
+  }
+
+  for (int transparent = 0; transparent < 2; transparent++) {
+    uint64_t st, ed, allocations;
+    uint32_t found = 0;
+
+    allocations = m_allocations;
+    st = NowMicros();
+    for (uint32_t i = 0; i < element_num; i++) {
+      string_key(buf, sizeof(buf), i);
+      auto it = transparent ? map.find(static_cast<const char *>(buf))
+                            : map.find(counted_string(buf));
+      if (it != map.end() && it->second == (int)i) {
+        found++;
+      }
+    }
+    ed = NowMicros();
+    allocations = m_allocations - allocations;
+
+    printf("lookup %" PRIu64 " string keys by %s, %u found, time cost %" PRIu64
+           " us, %" PRIu64 " allocations\n",
+           (uint64_t)element_num, transparent ? "const char *" : "std::string",
+           found, ed - st, allocations);
+  }
+}
+
+// pseudo random, so that the erased keys are spread over every cluster
+static bool erase_victim(int key, int percent) {
+  return (uint32_t)key * 2654435769u % 100 < (uint32_t)percent;
+}
+
+// single threaded: erase 10% to 90% of the map, once one element at a time
+// with erase(iterator) and once with erase_if
+void test_erase_if() {
+  ska::flat_hash_map<int, int> map;
+
+  for (int percent = 10; percent <= 90; percent += 20) {
+    for (int bulk = 0; bulk < 2; bulk++) {
+      uint64_t st, ed;
+      size_t erased = 0;
+
+      map.clear();
+      for (uint32_t i = 0; i < element_num; i++) {
+        map[i] = i;
+      }
+
+      st = NowMicros();
+      if (bulk) {
+        erased = map.erase_if([percent](const std::pair<int, int> &entry) {
+          return erase_victim(entry.first, percent);
+        });
+      } else {
+        for (auto it = map.begin(); it != map.end();) {
+          if (erase_victim(it->first, percent)) {
+            it = map.erase(it);
+            erased++;
+          } else {
+            ++it;
+          }
+        }
+      }
+      ed = NowMicros();
+
+      printf("erase %d%%, %" PRIu64 " of %" PRIu64 " elements by %s, time cost %" PRIu64 " us\n",
+             percent, (uint64_t)erased, (uint64_t)element_num,
+             bulk ? "erase_if" : "erase(iterator)", ed - st);
+    }
+  }
+}
+
+// single threaded, without a lock: the interleaved sherwood_v3_table
+// against soa_flat_hash_map on the same random keys, hits and misses
+template <typename Map>
+static void layout_lookup(const char *name, size_t slot_size) {
+  Map map;
+  std::mt19937 keys(42);
+
+  for (uint32_t i = 0; i < element_num; i++) {
+    int key = keys() & ~1u;
+    map[key] = key;
+  }
+
+  for (int miss = 0; miss < 2; miss++) {
+    uint64_t st, ed;
+    int64_t sum = 0;
+    uint32_t found = 0;
+
+    // the same keys again, odd ones are never in the map
+    keys.seed(42);
+    st = NowMicros();
+    for (uint32_t i = 0; i < element_num; i++) {
+      int key = (keys() & ~1u) | miss;
+      auto it = map.find(key);
+      if (it != map.end()) {
+        sum += it->second;
+        found++;
+      }
+    }
+    ed = NowMicros();
+
+    printf("%s: %zu buckets, %.1f MB, %s %u found, %.1f ns per find "
+           "(sum %" PRId64 ")\n",
+           name, map.bucket_count(),
+           map.bucket_count() * slot_size / 1048576.0,
+           miss ? "miss" : "hit", found, 1000.0 * (ed - st) / element_num,
+           sum);
+  }
+}
+
+void test_layout() {
+  layout_lookup<ska::flat_hash_map<int, int> >(
+      "interleaved",
+      sizeof(ska::detailv3::sherwood_v3_entry<std::pair<int, int> >));
+  layout_lookup<ska::soa_flat_hash_map<int, int> >(
+      "soa", sizeof(int8_t) + sizeof(std::pair<int, int>));
+}
+
+// AnonHugePages of the process in kB, 0 if the kernel doesn't say
+static uint64_t anon_huge_pages_kb() {
+  FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  uint64_t kb = 0;
+
+  if (!smaps) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), smaps)) {
+    if (sscanf(line, "AnonHugePages: %" SCNu64 " kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(smaps);
+  return kb;
+}
+
+// single threaded, without a lock: reserve() a table for element_num
+// random uint64 keys, insert them and look them up again
+template <typename Map>
+static void huge_page_lookup(const char *name) {
+  Map map;
+  std::mt19937_64 keys(42);
+  uint64_t st, reserve_us, insert_us, find_us;
+  uint64_t sum = 0;
+
+  st = NowMicros();
+  map.reserve(element_num);
+  reserve_us = NowMicros() - st;
+
+  st = NowMicros();
+  for (uint32_t i = 0; i < element_num; i++) {
+    map[keys()] = i;
+  }
+  insert_us = NowMicros() - st;
+
+  keys.seed(42);
+  st = NowMicros();
+  for (uint32_t i = 0; i < element_num; i++) {
+    auto it = map.find(keys());
+    if (it != map.end()) {
+      sum += it->second;
+    }
+  }
+  find_us = NowMicros() - st;
+
+  printf("%s: %zu buckets, reserve %" PRIu64 " us, insert %" PRIu64
+         " us, %.1f ns per find, AnonHugePages %" PRIu64 " kB (sum %" PRIu64
+         ")\n",
+         name, map.bucket_count(), reserve_us, insert_us,
+         1000.0 * find_us / element_num, anon_huge_pages_kb(), sum);
+}
+
+typedef std::pair<uint64_t, uint64_t> u64_pair;
+
+void test_huge_pages() {
+  huge_page_lookup<ska::flat_hash_map<uint64_t, uint64_t> >("std::allocator");
+  huge_page_lookup<ska::flat_hash_map<
+      uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+      ska::huge_page_allocator<u64_pair> > >("huge pages, madvise");
+  huge_page_lookup<ska::flat_hash_map<
+      uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+      ska::huge_page_allocator<u64_pair, ska::huge_page_prefault> > >(
+      "huge pages, madvise + prefault");
 }
 
 static void usage() {
   fprintf(stderr, "usage\n");
+  fprintf(stderr, "  -t thread_num\n");
+  fprintf(stderr, "  -e element_num\n");
+  fprintf(stderr, "  -p use ska::parallel_flat_hash_map with std::mutex\n");
+  fprintf(stderr, "  -s use ska::parallel_flat_hash_map with spin locks\n");
+  fprintf(stderr, "  -g use ska::simd_flat_hash_map with a global mutex\n");
+  fprintf(stderr, "  -a use ska::soa_flat_hash_map with a global mutex\n");
+  fprintf(stderr, "  -i use ska::incremental_flat_hash_map with a global mutex\n");
+  fprintf(stderr, "  -r use ska::snapshot_flat_hash_map, lookups without a lock,\n"
+                  "     a writer publishes a new version every %d ms\n",
+          kSnapshotUpdateMs);
+  fprintf(stderr, "  -l report the slowest single insert\n");
+  fprintf(stderr, "  -b plain|prefetch look up %d keys per lock, with find or find_batch\n",
+          kLookupBatch);
+  fprintf(stderr, "  -k look up std::string keys by const char *, single threaded\n");
+  fprintf(stderr, "  -d erase 10%% to 90%% of the map, by iterator and by erase_if, single threaded\n");
+  fprintf(stderr, "  -m look up keys that are not in the map\n");
+  fprintf(stderr, "  -o look up hits and misses in ska::flat_hash_map and ska::soa_flat_hash_map,\n"
+                  "     single threaded\n");
+  fprintf(stderr, "  -u reserve, insert and look up uint64 keys in ska::flat_hash_map on 4K pages\n"
+                  "     and on huge pages, single threaded\n");
 }
 
 int main(int argc, char *argv[])
 {
   char c;
-  char command[128];
 
-  while (-1 != (c = getopt(argc, argv, "ht:e:"))) {
+  while (-1 != (c = getopt(argc, argv, "ht:e:psgaiurlkdmob:"))) {
     switch (c) {
       case 't':
         thread_num = std::atol(optarg);
@@ -107,6 +623,53 @@ int main(int argc, char *argv[])
       case 'e':
         element_num = std::atol(optarg);
         break;
+      case 'p':
+        m_map_type = PARALLEL_MUTEX;
+        break;
+      case 's':
+        m_map_type = PARALLEL_SPIN;
+        break;
+      case 'g':
+        m_map_type = SIMD_GLOBAL_MUTEX;
+        break;
+      case 'a':
+        m_map_type = SOA_GLOBAL_MUTEX;
+        break;
+      case 'i':
+        m_map_type = INCREMENTAL_GLOBAL_MUTEX;
+        break;
+      case 'u':
+        m_huge_page_test = true;
+        break;
+      case 'r':
+        m_map_type = SNAPSHOT;
+        break;
+      case 'l':
+        m_insert_latency = true;
+        break;
+      case 'k':
+        m_string_keys = true;
+        break;
+      case 'b':
+        if (strcmp(optarg, "prefetch") == 0) {
+          m_batch_mode = BATCH_PREFETCH;
+        } else if (strcmp(optarg, "plain") == 0) {
+          m_batch_mode = BATCH_PLAIN;
+        } else {
+          usage();
+          return 0;
+        }
+        m_map_type = GLOBAL_MUTEX;
+        break;
+      case 'd':
+        m_erase_test = true;
+        break;
+      case 'm':
+        m_lookup_miss = true;
+        break;
+      case 'o':
+        m_layout_test = true;
+        break;
       case 'h':
         usage();
         return 0;
@@ -115,7 +678,28 @@ int main(int argc, char *argv[])
         return 0;
     }
   }
-  printf("thread_num %ld element_num %ld\n", thread_num, element_num);
+  if (m_string_keys) {
+    printf("element_num %u, string keys\n", element_num);
+    test_string_lookup();
+    return 0;
+  }
+  if (m_erase_test) {
+    printf("element_num %u, erase\n", element_num);
+    test_erase_if();
+    return 0;
+  }
+  if (m_layout_test) {
+    printf("element_num %u, layout\n", element_num);
+    test_layout();
+    return 0;
+  }
+  if (m_huge_page_test) {
+    printf("element_num %u, huge pages\n", element_num);
+    test_huge_pages();
+    return 0;
+  }
+  printf("thread_num %u element_num %u, %s\n", thread_num, element_num,
+         map_type_names[m_map_type]);
 
   test_hash_insert();
 
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <sched.h>
+
+#include "flat_hash_map.hpp"
+
+namespace ska
+{
+
+// A flat_hash_map for tables that are read all the time and written
+// rarely. Every version is an immutable flat_hash_map. The writer builds the
+// next version off to the side and publishes it with one atomic pointer
+// swap, readers look things up in whichever version is current without
+// taking a lock.
+//
+// A replaced version is freed once every reader that could still be
+// looking at it has finished, which is tracked with epochs: each reader
+// owns a slot and stores the global epoch in it before it loads the
+// current version, and clears it when it's done. Every publish bumps the
+// epoch, so a version retired at epoch e can go once no slot holds an
+// epoch below e. Readers never wait for the writer, the writer never waits
+// for readers unless it calls synchronize().
+//
+// There is one writer: publish, update, reclaim and synchronize must not
+// run concurrently with each other, the caller serializes them. Readers
+// each need a reader, which claims one of the MaxReaders slots for as
+// long as it lives, and is used by one thread at a time.
+//
+//     ska::snapshot_flat_hash_map<std::string, route> routes;
+//     // writer
+//     routes.update([&](ska::flat_hash_map<std::string, route> & next) { next[name] = r; });
+//     // each reader thread
+//     auto reader = routes.get_reader();
+//     route r;
+//     if (reader.find(name, r)) ...
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> >, size_t MaxReaders = 128>
+class snapshot_flat_hash_map
+{
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using Map = flat_hash_map<K, V, H, E, A>;
+
+private:
+    // one per cache line, readers only ever write their own
+    struct alignas(64) reader_slot
+    {
+        std::atomic<bool> in_use{false};
+        // the epoch when the current read started, 0 if not reading
+        std::atomic<uint64_t> epoch{0};
+    };
+
+public:
+    snapshot_flat_hash_map()
+        : current_version(new Map())
+    {
+    }
+    explicit snapshot_flat_hash_map(Map initial)
+        : current_version(new Map(std::move(initial)))
+    {
+    }
+    snapshot_flat_hash_map(const snapshot_flat_hash_map &) = delete;
+    snapshot_flat_hash_map & operator=(const snapshot_flat_hash_map &) = delete;
+    // no reader may be alive
+    ~snapshot_flat_hash_map()
+    {
+        delete current_version.load(std::memory_order_relaxed);
+        for (const retired_version & retired : retired_versions)
+            delete retired.map;
+    }
+
+    // keeps a version alive while it's held, the reader can't start
+    // another read until it's gone
+    class read_guard
+    {
+    public:
+        read_guard(read_guard && other) noexcept
+            : slot(other.slot), map(other.map)
+        {
+            other.slot = nullptr;
+        }
+        read_guard & operator=(const read_guard &) = delete;
+        ~read_guard()
+        {
+            if (slot)
+                slot->epoch.store(0, std::memory_order_release);
+        }
+
+        const Map & operator*() const
+        {
+            return *map;
+        }
+        const Map * operator->() const
+        {
+            return map;
+        }
+
+    private:
+        friend class snapshot_flat_hash_map;
+        read_guard(const snapshot_flat_hash_map & owner, reader_slot & slot)
+            : slot(&slot)
+        {
+            // seq_cst: the writer must either see the epoch in the slot or
+            // have published before the load below
+            slot.epoch.store(owner.epoch.load(std::memory_order_acquire), std::memory_order_seq_cst);
+            map = owner.current_version.load(std::memory_order_seq_cst);
+        }
+
+        reader_slot * slot;
+        const Map * map;
+    };
+
+    class reader
+    {
+    public:
+        reader(reader && other) noexcept
+            : owner(other.owner), slot(other.slot)
+        {
+            other.slot = nullptr;
+        }
+        reader & operator=(const reader &) = delete;
+        ~reader()
+        {
+            if (slot)
+                slot->in_use.store(false, std::memory_order_release);
+        }
+
+        read_guard read() const
+        {
+            return read_guard(*owner, *slot);
+        }
+
+        // copies the value of the key to 'value', returns false if not found
+        bool find(const K & key, V & value) const
+        {
+            read_guard guard = read();
+            auto found = guard->find(key);
+            if (found == guard->end())
+                return false;
+            value = found->second;
+            return true;
+        }
+        size_t count(const K & key) const
+        {
+            return read()->count(key);
+        }
+        size_t size() const
+        {
+            return read()->size();
+        }
+
+    private:
+        friend class snapshot_flat_hash_map;
+        reader(const snapshot_flat_hash_map & owner, reader_slot & slot)
+            : owner(&owner), slot(&slot)
+        {
+        }
+
+        const snapshot_flat_hash_map * owner;
+        reader_slot * slot;
+    };
+
+    // claims a reader slot, throws std::length_error if all MaxReaders are
+    // taken
+    reader get_reader() const
+    {
+        for (reader_slot & slot : slots)
+        {
+            if (!slot.in_use.load(std::memory_order_relaxed) && !slot.in_use.exchange(true, std::memory_order_acquire))
+                return reader(*this, slot);
+        }
+        throw std::length_error("All reader slots of the snapshot_flat_hash_map are in use.");
+    }
+
+    // the version readers see now. Only for the writer: a reader has to go
+    // through a reader, the writer is the only one that frees versions.
+    const Map & current() const
+    {
+        return *current_version.load(std::memory_order_relaxed);
+    }
+
+    // makes next the current version. Frees the versions that no reader
+    // can see anymore, the one that was just replaced isn't among them
+    // unless no reader was reading.
+    void publish(Map next)
+    {
+        Map * previous = current_version.exchange(new Map(std::move(next)), std::memory_order_seq_cst);
+        uint64_t retired_at = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+        retired_versions.push_back({ previous, retired_at });
+        reclaim();
+    }
+    // copies the current version, calls f(Map &) on the copy and publishes
+    // it. Every update copies the whole table, batch changes into one.
+    template<typename F>
+    void update(F && f)
+    {
+        Map next(current());
+        f(next);
+        publish(std::move(next));
+    }
+
+    // frees the replaced versions that no reader can see anymore and
+    // returns how many are left
+    size_t reclaim()
+    {
+        uint64_t oldest = oldest_reader_epoch();
+        auto still_visible = retired_versions.begin();
+        for (const retired_version & retired : retired_versions)
+        {
+            if (retired.retired_at <= oldest)
+                delete retired.map;
+            else
+                *still_visible++ = retired;
+        }
+        retired_versions.erase(still_visible, retired_versions.end());
+        return retired_versions.size();
+    }
+    // waits until all replaced versions are freed
+    void synchronize()
+    {
+        while (reclaim())
+            sched_yield();
+    }
+
+private:
+    struct retired_version
+    {
+        Map * map;
+        uint64_t retired_at;
+    };
+
+    // readers that started at this epoch or later can only have seen
+    // versions that were current then
+    uint64_t oldest_reader_epoch() const
+    {
+        uint64_t oldest = uint64_t(-1);
+        for (const reader_slot & slot : slots)
+        {
+            uint64_t reading = slot.epoch.load(std::memory_order_seq_cst);
+            if (reading && reading < oldest)
+                oldest = reading;
+        }
+        return oldest;
+    }
+
+    std::atomic<Map *> current_version;
+    std::atomic<uint64_t> epoch{1};
+    mutable reader_slot slots[MaxReaders];
+    std::vector<retired_version> retired_versions;
+};
+
+} // end namespace ska
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "flat_hash_map.hpp"
+
+namespace ska
+{
+
+// A structure-of-arrays layout for sherwood_v3_table: the distances from
+// the desired slot live in a dense array of int8_t and the values in a
+// parallel array. sherwood_v3_entry<std::pair<int, int>> pads to 12 bytes
+// for one byte of distance, here a slot costs 9 bytes, and a probe walk
+// reads 64 distances per cache line. The values array is only touched for
+// the slots whose distance says the key could be there, so lookups that
+// miss mostly stay in the distance array.
+//
+// The price is a second cache miss on a hit, the distance and the value
+// are no longer next to each other. Prefer this layout when most lookups
+// miss or when the value is small enough that the padding matters.
+struct soa_layout
+{
+    template<typename T, typename EntryAlloc>
+    struct slots
+    {
+        using ValueAlloc = typename std::allocator_traits<EntryAlloc>::template rebind_alloc<T>;
+        using ValueAllocTraits = std::allocator_traits<ValueAlloc>;
+        using DistanceAlloc = typename std::allocator_traits<EntryAlloc>::template rebind_alloc<int8_t>;
+        using DistanceAllocTraits = std::allocator_traits<DistanceAlloc>;
+        static constexpr int8_t special_end_value = 0;
+
+        // what sherwood_v3_entry is for aos_layout, but refers to a slot
+        // of both arrays
+        struct entry
+        {
+            int8_t & distance_from_desired;
+            // not constructed unless has_value()
+            T & value;
+
+            bool has_value() const
+            {
+                return distance_from_desired >= 0;
+            }
+            bool is_empty() const
+            {
+                return distance_from_desired < 0;
+            }
+            bool is_at_desired_position() const
+            {
+                return distance_from_desired <= 0;
+            }
+            template<typename... Args>
+            void emplace(int8_t distance, Args &&... args)
+            {
+                new (std::addressof(value)) T(std::forward<Args>(args)...);
+                distance_from_desired = distance;
+            }
+            void destroy_value()
+            {
+                value.~T();
+                distance_from_desired = -1;
+            }
+        };
+        struct entry_arrow
+        {
+            entry ref;
+            entry * operator->()
+            {
+                return &ref;
+            }
+        };
+
+        // the distance and the value of a slot, moved together
+        struct pointer
+        {
+            pointer() = default;
+            pointer(std::nullptr_t)
+            {
+            }
+            pointer(int8_t * distance, T * value)
+                : distance(distance), value(value)
+            {
+            }
+
+            entry_arrow operator->() const
+            {
+                return { { *distance, *value } };
+            }
+            explicit operator bool() const
+            {
+                return distance != nullptr;
+            }
+
+            pointer & operator++()
+            {
+                ++distance;
+                ++value;
+                return *this;
+            }
+            pointer operator+(ptrdiff_t offset) const
+            {
+                return { distance + offset, value + offset };
+            }
+            pointer operator-(ptrdiff_t offset) const
+            {
+                return { distance - offset, value - offset };
+            }
+            ptrdiff_t operator-(const pointer & other) const
+            {
+                return distance - other.distance;
+            }
+            friend bool operator==(const pointer & lhs, const pointer & rhs)
+            {
+                return lhs.distance == rhs.distance;
+            }
+            friend bool operator!=(const pointer & lhs, const pointer & rhs)
+            {
+                return lhs.distance != rhs.distance;
+            }
+            friend bool operator<(const pointer & lhs, const pointer & rhs)
+            {
+                return lhs.distance < rhs.distance;
+            }
+
+            int8_t * distance = nullptr;
+            T * value = nullptr;
+        };
+
+        // the values array has a slot less, the special end value doesn't
+        // need one
+        static pointer empty_default_table()
+        {
+            static int8_t distances[detailv3::min_lookups] = { -1, -1, -1, special_end_value };
+            static typename std::aligned_storage<sizeof(T), alignof(T)>::type values[detailv3::min_lookups - 1];
+            return { distances, reinterpret_cast<T *>(values) };
+        }
+        static pointer allocate(EntryAlloc & alloc, size_t num_slots)
+        {
+            DistanceAlloc distance_alloc(alloc);
+            ValueAlloc value_alloc(alloc);
+            int8_t * distances = DistanceAllocTraits::allocate(distance_alloc, num_slots);
+            try
+            {
+                return { distances, ValueAllocTraits::allocate(value_alloc, num_slots - 1) };
+            }
+            catch (...)
+            {
+                DistanceAllocTraits::deallocate(distance_alloc, distances, num_slots);
+                throw;
+            }
+        }
+        static void deallocate(EntryAlloc & alloc, pointer begin, size_t num_slots)
+        {
+            DistanceAlloc distance_alloc(alloc);
+            ValueAlloc value_alloc(alloc);
+            DistanceAllocTraits::deallocate(distance_alloc, begin.distance, num_slots);
+            ValueAllocTraits::deallocate(value_alloc, begin.value, num_slots - 1);
+        }
+    };
+};
+
+// ska::flat_hash_map with the structure-of-arrays layout: the same table,
+// hash policies, growth and erase as flat_hash_map, only the slots are
+// stored differently.
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>, typename A = std::allocator<std::pair<K, V> > >
+using soa_flat_hash_map = flat_hash_map<K, V, H, E, A, soa_layout>;
+
+} // end namespace ska